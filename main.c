@@ -2,44 +2,153 @@
 #define MMENU_IMPLEMENTATION
 #include "mmenu.h"
 
+#include <dirent.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <linux/magic.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
 
 #define LINE_BUF_SIZE 4096
 #define CHUNK_CAP (1024 * 1024)   /* 1 MiB slabs for string data - huge reduction in mallocs */
 
 typedef struct {
     char **lines;     /* pointers into slabs (or final compact) */
-    int cap;
-    int count;
+    unsigned long long *masks;  /* mmenu_charmask() per line, for the scan prefilter */
+    unsigned char *flags;       /* mmenu_utf8_flags() per line, for drawing */
+    long long cap;    /* 64-bit: inventories can pass 2^31 lines */
+    long long count;
 
     /* Chunked string arena: O(total/CHUNK) mallocs instead of O(N) */
     char **slabs;     /* the raw data blocks */
     int slabs_cap;
     int slabs_count;
     size_t slab_used; /* used bytes in the current (last) slab */
+    long long *slab_first;  /* index of the first line stored in each slab */
+    size_t *slab_size;
+
+    /* Memory budget (--max-memory). When malloc'd slabs would exceed it, the
+       oldest sealed slabs are written to an unlinked temp file and mapped back
+       read-only; the line table is rebased onto the mapping and stays resident.
+       Spilling is oldest-first, so slabs [0, spilled) are mappings and a
+       sequential scan walks the file front to back. */
+    size_t max_memory; /* 0 = unlimited */
+    size_t resident;   /* bytes held in malloc'd slabs */
+    int spilled;
+    int spill_fd;      /* valid once spilled > 0 */
+    off_t spill_off;
 } lines_t;
 
-static void lines_push(lines_t *l, char *s) {
+/* Append line s (len bytes, already in the arena) with its mask and UTF-8
+   flags, both computed while the bytes are still hot in cache. */
+static void lines_push(lines_t *l, char *s, size_t len) {
     if (l->count == l->cap) {
         l->cap = l->cap ? l->cap * 2 : INITIAL_CAP;
-        l->lines = realloc(l->lines, l->cap * sizeof(char*));
-        if (!l->lines) { perror("realloc"); exit(1); }
+        l->lines = realloc(l->lines, (size_t)l->cap * sizeof(char*));
+        l->masks = realloc(l->masks, (size_t)l->cap * sizeof(unsigned long long));
+        l->flags = realloc(l->flags, (size_t)l->cap);
+        if (!l->lines || !l->masks || !l->flags) { perror("realloc"); exit(1); }
     }
+    l->masks[l->count] = mmenu_charmask(s, len);
+    l->flags[l->count] = mmenu_utf8_flags(s, len);
     l->lines[l->count++] = s;
 }
 
-/* Allocate a new 1MB slab and make it current. */
-static void lines_new_slab(lines_t *l) {
+/* The spill file goes to $TMPDIR, else /var/tmp: /tmp is often tmpfs,
+   where spilled pages would still be RAM (shmem, charged to the same
+   cgroup and only reclaimable to swap), so nothing would be saved. */
+static int spill_open(void) {
+    const char *dir = getenv("TMPDIR");
+    if (!dir || !*dir) dir = "/var/tmp";
+    int fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/mmenu-spill-XXXXXX", dir);
+        fd = mkstemp(path);
+        if (fd < 0) { perror("mkstemp spill file"); exit(1); }
+        unlink(path);
+    }
+    struct statfs sfs;
+    if (fstatfs(fd, &sfs) == 0 && sfs.f_type == TMPFS_MAGIC)
+        fprintf(stderr, "mmenu: spill directory %s is tmpfs, so --max-memory saves no RAM; "
+                        "set TMPDIR to a disk-backed directory\n", dir);
+    return fd;
+}
+
+/* Move the oldest resident slab to the spill file. Only the bytes up to
+   the end of its last line are written and mapped; the unused tail of a
+   sealed slab is dropped. */
+static void lines_spill_one(lines_t *l) {
+    int i = l->spilled;
+    if (i == 0) l->spill_fd = spill_open();
+    char *slab = l->slabs[i];
+    long long end = i + 1 < l->slabs_count ? l->slab_first[i + 1] : l->count;
+    size_t size = end > l->slab_first[i] ? (size_t)(l->lines[end - 1] - slab) + strlen(l->lines[end - 1]) + 1 : 1;
+    for (size_t done = 0; done < size; ) {
+        ssize_t w = pwrite(l->spill_fd, slab + done, size - done, l->spill_off + (off_t)done);
+        if (w < 0) { if (errno == EINTR) continue; perror("write spill file"); exit(1); }
+        done += (size_t)w;
+    }
+    char *map = mmap(NULL, size, PROT_READ, MAP_SHARED, l->spill_fd, l->spill_off);
+    if (map == MAP_FAILED) { perror("mmap spill file"); exit(1); }
+    madvise(map, size, MADV_SEQUENTIAL);
+
+    for (long long j = l->slab_first[i]; j < end; j++) l->lines[j] = map + (l->lines[j] - slab);
+    free(slab);
+
+    long page = sysconf(_SC_PAGESIZE);
+    l->slabs[i] = map;
+    l->resident -= l->slab_size[i];
+    l->slab_size[i] = size;
+    l->spill_off += (off_t)((size + page - 1) / page * page);   /* mmap offsets must be page aligned */
+    l->spilled++;
+}
+
+/* Bytes of line table and slab bookkeeping; never spilled. */
+static size_t lines_meta(const lines_t *l) {
+    return (size_t)l->cap * (sizeof(char*) + sizeof(unsigned long long) + 1)
+         + (size_t)l->slabs_cap * (sizeof(char*) + sizeof(long long) + sizeof(size_t));
+}
+
+/* Register a freshly allocated slab of size bytes, spilling older slabs
+   first if it would push us over the budget. */
+static void lines_add_slab(lines_t *l, char *slab, size_t size) {
     if (l->slabs_count == l->slabs_cap) {
         l->slabs_cap = l->slabs_cap ? l->slabs_cap * 2 : 4;
         l->slabs = realloc(l->slabs, l->slabs_cap * sizeof(char*));
-        if (!l->slabs) { perror("realloc slabs"); exit(1); }
+        l->slab_first = realloc(l->slab_first, l->slabs_cap * sizeof(long long));
+        l->slab_size = realloc(l->slab_size, l->slabs_cap * sizeof(size_t));
+        if (!l->slabs || !l->slab_first || !l->slab_size) { perror("realloc slabs"); exit(1); }
+    }
+    if (l->max_memory) {
+        /* The line table is hot metadata: it always stays resident and counts against the budget */
+        size_t meta = lines_meta(l);
+        size_t allowed = l->max_memory > meta ? l->max_memory - meta : 0;
+        while (l->spilled < l->slabs_count && l->resident + size > allowed) lines_spill_one(l);
     }
+    l->slabs[l->slabs_count] = slab;
+    l->slab_first[l->slabs_count] = l->count;
+    l->slab_size[l->slabs_count] = size;
+    l->slabs_count++;
+    l->resident += size;
+}
+
+/* Allocate a new 1MB slab and make it current. */
+static void lines_new_slab(lines_t *l) {
     char *slab = malloc(CHUNK_CAP);
     if (!slab) { perror("malloc slab"); exit(1); }
-    l->slabs[l->slabs_count++] = slab;
+    lines_add_slab(l, slab, CHUNK_CAP);
     l->slab_used = 0;
 }
 
@@ -48,16 +157,12 @@ static void lines_new_slab(lines_t *l) {
 static char *lines_arena_dup(lines_t *l, const char *src, size_t len) {
     if (len + 1 > CHUNK_CAP) {
         /* Rare: huge single line >1MB. Give it its own slab. */
-        if (l->slabs_count == l->slabs_cap) {
-            l->slabs_cap = l->slabs_cap ? l->slabs_cap * 2 : 4;
-            l->slabs = realloc(l->slabs, l->slabs_cap * sizeof(char*));
-            if (!l->slabs) { perror("realloc slabs"); exit(1); }
-        }
         char *big = malloc(len + 1);
         if (!big) { perror("malloc bigline"); exit(1); }
         memcpy(big, src, len);
         big[len] = '\0';
-        l->slabs[l->slabs_count++] = big;
+        lines_add_slab(l, big, len + 1);
+        l->slab_used = CHUNK_CAP;   /* sealed: the next line starts a fresh slab */
         return big;
     }
 
@@ -71,72 +176,1873 @@ static char *lines_arena_dup(lines_t *l, const char *src, size_t len) {
     return dst;
 }
 
-int main(int argc, char **argv) {
-    /* Faster buffered input for huge pipes */
-    setvbuf(stdin, NULL, _IOFBF, 64 * 1024);
+/* Read every line of f into the arena. */
+static void lines_load(lines_t *l, FILE *f) {
+    char buf[LINE_BUF_SIZE];
+    while (fgets(buf, sizeof(buf), f)) {
+        size_t len = strlen(buf);
+        if (len > 0 && buf[len-1] == '\n') buf[--len] = '\0';
+        else if (len == sizeof(buf)-1) {
+            int c;
+            while ((c = getc(f)) != EOF && c != '\n');
+        }
+        /* Store in chunked arena instead of per-line malloc */
+        lines_push(l, lines_arena_dup(l, buf, len), len);
+    }
+    if (l->max_memory && lines_meta(l) > l->max_memory)
+        fprintf(stderr, "mmenu: line table (%zu MiB) alone exceeds --max-memory (%zu MiB); "
+                        "only line text was spilled\n", lines_meta(l) >> 20, l->max_memory >> 20);
+}
 
-    lines_t opts = {0};
+/* Free the O(1) pointer array + the O(total_size / CHUNK) slabs.
+   Massively fewer frees than before (N individual string frees). */
+static void lines_free(lines_t *l) {
+    free(l->lines);
+    free(l->masks);
+    free(l->flags);
+    for (int i = 0; i < l->slabs_count; i++) {
+        if (i < l->spilled) munmap(l->slabs[i], l->slab_size[i]);
+        else free(l->slabs[i]);
+    }
+    if (l->spilled) close(l->spill_fd);
+    free(l->slabs);
+    free(l->slab_first);
+    free(l->slab_size);
+}
+
+/* Parse sizes like 512M, 2G, 65536 (binary suffixes). Returns 0 on error. */
+static size_t parse_size(const char *s) {
+    char *end;
+    unsigned long long v = strtoull(s, &end, 10);
+    switch (*end) {
+    case 'k': case 'K': v <<= 10; end++; break;
+    case 'm': case 'M': v <<= 20; end++; break;
+    case 'g': case 'G': v <<= 30; end++; break;
+    }
+    if (*end == 'i') end++;
+    if (*end == 'B' || *end == 'b') end++;
+    return *end ? 0 : (size_t)v;
+}
+
+/* Non-interactive filter shared by --filter and the daemon. Returns the
+   number of matching lines written to out. With typos, lines come out
+   ranked by edit count (input order within the same count). */
+static long filter_write(const lines_t *l, const char *query, int output_index, int typos,
+                         FILE *out) {
+    long n = 0;
+    unsigned long long qmask = mmenu_charmask(query, strlen(query));
+    int k = mm_query_k(query, typos);
+    if (k) {
+        mm_approx_t ap;
+        mm_approx_init(&ap, query, k);
+        filt *rank = malloc((size_t)(k + 1) * sizeof(filt));
+        if (!rank) { perror("malloc"); exit(1); }
+        for (int e = 0; e <= k; e++) { filt_init(&rank[e]); rank[e].universe = l->count; }
+        MM_FOREACH_CANDIDATE_K(i, l->masks, l->count, qmask, k, {
+            int e = mm_approx(&ap, l->lines[i]);
+            if (e >= 0) filt_push(&rank[e], i, 0);
+        });
+        for (int e = 0; e <= k; e++) {
+            FILT_FOREACH(&rank[e], r, i, off, {
+                if (output_index) fprintf(out, "%lld\n", i);
+                else fprintf(out, "%s\n", l->lines[i]);
+                n++;
+            });
+            filt_free(&rank[e]);
+        }
+        free(rank);
+        return n;
+    }
+    MM_FOREACH_CANDIDATE(i, l->masks, l->count, qmask, {
+        if (strcasestr(l->lines[i], query)) {
+            if (output_index) fprintf(out, "%lld\n", i);
+            else fprintf(out, "%s\n", l->lines[i]);
+            n++;
+        }
+    });
+    return n;
+}
+
+/* ---- Front-coded path storage (--paths) -----------------------------------
+   find/locate output is sorted enough that consecutive lines share long
+   directory prefixes. Each line is stored as (shared prefix length with the
+   previous line, suffix length, suffix bytes), both lengths as varints; every
+   FC_BLOCK-th line is a restart stored in full, so line i is reachable by
+   decoding at most FC_BLOCK entries. Sequential access (scans, redraws of a
+   window) keeps a cursor and decodes one entry per line.
+
+   Matching reuses the previous line's result: if its first match ended
+   inside the shared prefix, this line matches at the same offset without a
+   search, so a query hitting a directory accepts the whole subtree. Otherwise
+   any match must cross the end of the shared prefix, and the search starts
+   at max(0, lcp - qlen + 1). */
+
+#define FC_BLOCK 16
+
+typedef struct {
+    unsigned char *data;
+    size_t len, cap;
+    size_t *block_off;            /* entry offset of every FC_BLOCK-th line */
+    unsigned long long *masks;
+    long long count, lines_cap;
+    /* Decoding cursor: line cur is in line[] and the next entry starts at next_off */
+    long long cur;
+    size_t next_off;
+    char line[LINE_BUF_SIZE];
+    size_t line_len;
+} fc_t;
+
+static void fc_put_varint(fc_t *f, size_t v) {
+    do {
+        unsigned char b = v & 0x7f;
+        v >>= 7;
+        f->data[f->len++] = b | (v ? 0x80 : 0);
+    } while (v);
+}
+
+static size_t fc_get_varint(const unsigned char **p) {
+    size_t v = 0;
+    int shift = 0;
+    unsigned char b;
+    do {
+        b = *(*p)++;
+        v |= (size_t)(b & 0x7f) << shift;
+        shift += 7;
+    } while (b & 0x80);
+    return v;
+}
+
+static void fc_push(fc_t *f, const char *s, size_t len) {
+    if (f->count == f->lines_cap) {
+        f->lines_cap = f->lines_cap ? f->lines_cap * 2 : INITIAL_CAP;
+        f->masks = realloc(f->masks, (size_t)f->lines_cap * sizeof(unsigned long long));
+        f->block_off = realloc(f->block_off, ((size_t)f->lines_cap / FC_BLOCK + 1) * sizeof(size_t));
+        if (!f->masks || !f->block_off) { perror("realloc"); exit(1); }
+    }
+    size_t lcp = 0;
+    if (f->count % FC_BLOCK == 0) {
+        f->block_off[f->count / FC_BLOCK] = f->len;
+    } else {
+        /* line[] still holds the previous line pushed */
+        while (lcp < len && lcp < f->line_len && s[lcp] == f->line[lcp]) lcp++;
+    }
+    if (f->len + len - lcp + 20 > f->cap) {
+        /* Large reallocs are mremap()ed by glibc, so growth does not copy */
+        f->cap = f->cap ? f->cap * 2 : CHUNK_CAP;
+        while (f->len + len - lcp + 20 > f->cap) f->cap *= 2;
+        f->data = realloc(f->data, f->cap);
+        if (!f->data) { perror("realloc"); exit(1); }
+    }
+    fc_put_varint(f, lcp);
+    fc_put_varint(f, len - lcp);
+    memcpy(f->data + f->len, s + lcp, len - lcp);
+    f->len += len - lcp;
+    memcpy(f->line + lcp, s + lcp, len - lcp);
+    f->line[len] = '\0';
+    f->line_len = len;
+    f->masks[f->count++] = mmenu_charmask(s, len);
+    f->cur = -2;   /* no cursor: the next access restarts at a block head */
+}
+
+static void fc_load(fc_t *f, FILE *in) {
     char buf[LINE_BUF_SIZE];
+    while (fgets(buf, sizeof(buf), in)) {
+        size_t len = strlen(buf);
+        if (len > 0 && buf[len-1] == '\n') buf[--len] = '\0';
+        else if (len == sizeof(buf)-1) {
+            int c;
+            while ((c = getc(in)) != EOF && c != '\n');
+        }
+        fc_push(f, buf, len);
+    }
+}
+
+/* Decode line i (NUL-terminated, valid until the next call). *lcp receives
+   a lower bound on the prefix it shares with line i - 1. */
+static const char *fc_line(fc_t *f, long long i, size_t *lcp) {
+    size_t shared = 0;
+    if (i != f->cur + 1) {
+        if (i != f->cur) {
+            /* Random access: restart at the block head and decode forward */
+            long long b = i / FC_BLOCK;
+            f->cur = b * FC_BLOCK - 1;
+            f->next_off = f->block_off[b];
+            while (f->cur < i) fc_line(f, f->cur + 1, NULL);
+        }
+        if (lcp) *lcp = 0;
+        return f->line;
+    }
+    const unsigned char *p = f->data + f->next_off;
+    shared = fc_get_varint(&p);
+    size_t n = fc_get_varint(&p);
+    memcpy(f->line + shared, p, n);
+    f->line_len = shared + n;
+    f->line[f->line_len] = '\0';
+    f->next_off = (size_t)(p + n - f->data);
+    f->cur = i;
+    if (lcp) *lcp = shared;
+    return f->line;
+}
+
+/* Report every line in [from, to) containing q (case-insensitive), with the
+   offset of its first match, reusing the previous line's result where the
+   shared prefix allows. */
+static void fc_scan(fc_t *f, const char *q, long long from, long long to,
+                    void (*hit)(void *ctx, long long i, int off), void *ctx) {
+    size_t qlen = strlen(q);
+    unsigned long long qmask = mmenu_charmask(q, qlen);
+    long pm = -1;   /* first match offset in the previous line, -1 if none */
+    for (long long i = from; i < to; i++) {
+        size_t lcp;
+        const char *s = fc_line(f, i, &lcp);
+        if (i == from) lcp = 0;
+        long m = -1;
+        if (pm >= 0 && (size_t)pm + qlen <= lcp) {
+            m = pm;
+        } else if ((f->masks[i] & qmask) == qmask) {
+            const char *r = strcasestr(s + (lcp >= qlen ? lcp - qlen + 1 : 0), q);
+            if (r) m = r - s;
+        }
+        pm = m;
+        if (m >= 0) hit(ctx, i, (int)m);
+    }
+}
+
+static void fc_free(fc_t *f) {
+    free(f->data);
+    free(f->block_off);
+    free(f->masks);
+}
+
+/* mmenu_vlist callbacks: the menu pulls rows straight out of the coded data */
+static const char *fc_fetch(void *ud, long long i, char *buf, size_t cap) {
+    (void)buf; (void)cap;
+    return fc_line(ud, i, NULL);
+}
+
+static void fc_match(void *ud, const char *q, long long from, long long to,
+                     void (*hit)(void *ctx, long long i, int off), void *ctx) {
+    fc_scan(ud, q, from, to, hit, ctx);
+}
+
+typedef struct { fc_t *f; int output_index; FILE *out; long n; } fc_filter_ctx;
+
+static void fc_filter_hit(void *ctx, long long i, int off) {
+    fc_filter_ctx *c = ctx;
+    (void)off;
+    if (c->output_index) fprintf(c->out, "%lld\n", i);
+    else fprintf(c->out, "%s\n", c->f->line);   /* the line just scanned */
+    c->n++;
+}
+
+/* ---- Block-compressed corpus (--compress) ----------------------------------
+   For inputs whose raw text does not fit in RAM. Lines are staged into
+   blocks of up to ZC_BLOCK bytes (NUL-terminated, so a decoded block is
+   directly usable) which are then sealed with the small LZ77 codec below.
+   Each block keeps a 16-bit line offset table and the OR of its lines'
+   character masks, so a block that cannot contain the query is skipped
+   without being decoded. Scans decode blocks into per-thread 64 KiB buffers
+   that stay in L2 (the worker threads pull blocks from a shared counter), so
+   the cost tracks the compressed bytes read. Rows fetched for display go
+   through a small cache of decoded blocks. */
+
+#define ZC_BLOCK (64 * 1024)
+#define ZC_CACHE 8             /* decoded blocks kept for display */
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 13
+
+/* LZ77 in the LZ4 mould: sequences of (token, literals, 16-bit offset,
+   match), the token holding 4-bit literal and match lengths with 255-run
+   extensions. The stream ends with a literal-only sequence. */
+static size_t lz_put_len(unsigned char *op, size_t len) {
+    size_t n = 0;
+    while (len >= 255) { op[n++] = 255; len -= 255; }
+    op[n++] = (unsigned char)len;
+    return n;
+}
+
+/* Compress src[0, n) into dst, which must hold n + n / 255 + 16 bytes. */
+static size_t lz_compress(const unsigned char *src, size_t n, unsigned char *dst) {
+    unsigned int table[1 << LZ_HASH_BITS];
+    memset(table, 0xff, sizeof(table));
+    unsigned char *op = dst;
+    size_t anchor = 0, ip = 0;
+    while (n >= LZ_MIN_MATCH + 1 && ip + LZ_MIN_MATCH + 1 <= n) {
+        unsigned int v;
+        memcpy(&v, src + ip, 4);
+        unsigned int h = (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+        unsigned int cand = table[h];
+        table[h] = (unsigned int)ip;
+        unsigned int w;
+        if (cand == 0xffffffffu || ip - cand > 0xffff || (memcpy(&w, src + cand, 4), w != v)) {
+            ip++;
+            continue;
+        }
+        size_t mlen = LZ_MIN_MATCH;
+        while (ip + mlen < n && src[cand + mlen] == src[ip + mlen]) mlen++;
+        size_t lit = ip - anchor;
+        unsigned char *token = op++;
+        *token = (unsigned char)((lit < 15 ? lit : 15) << 4);
+        if (lit >= 15) op += lz_put_len(op, lit - 15);
+        memcpy(op, src + anchor, lit);
+        op += lit;
+        unsigned int off = (unsigned int)(ip - cand);
+        *op++ = off & 0xff;
+        *op++ = off >> 8;
+        size_t ml = mlen - LZ_MIN_MATCH;
+        *token |= ml < 15 ? ml : 15;
+        if (ml >= 15) op += lz_put_len(op, ml - 15);
+        ip += mlen;
+        anchor = ip;
+    }
+    size_t lit = n - anchor;
+    *op++ = (unsigned char)((lit < 15 ? lit : 15) << 4);
+    if (lit >= 15) op += lz_put_len(op, lit - 15);
+    memcpy(op, src + anchor, lit);
+    op += lit;
+    return (size_t)(op - dst);
+}
+
+/* Decode a stream produced by lz_compress(); returns the raw size, or 0 if
+   the input is malformed or would overflow dst. */
+static size_t lz_decompress(const unsigned char *src, size_t n, unsigned char *dst, size_t cap) {
+    const unsigned char *ip = src, *end = src + n;
+    unsigned char *op = dst, *oend = dst + cap;
+    while (ip < end) {
+        unsigned int token = *ip++;
+        size_t lit = token >> 4;
+        if (lit == 15) {
+            unsigned char b;
+            do { if (ip >= end) return 0; b = *ip++; lit += b; } while (b == 255);
+        }
+        if ((size_t)(end - ip) < lit || (size_t)(oend - op) < lit) return 0;
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+        if (ip >= end) break;   /* final literal-only sequence */
+        if (end - ip < 2) return 0;
+        size_t off = ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        size_t mlen = token & 15;
+        if (mlen == 15) {
+            unsigned char b;
+            do { if (ip >= end) return 0; b = *ip++; mlen += b; } while (b == 255);
+        }
+        mlen += LZ_MIN_MATCH;
+        if (!off || off > (size_t)(op - dst) || (size_t)(oend - op) < mlen) return 0;
+        const unsigned char *m = op - off;
+        if (off >= mlen) memcpy(op, m, mlen);
+        else for (size_t k = 0; k < mlen; k++) op[k] = m[k];   /* overlapping run */
+        op += mlen;
+    }
+    return (size_t)(op - dst);
+}
+
+typedef struct {
+    unsigned char *data;          /* compressed bytes */
+    unsigned int clen, rlen;
+    long long first;              /* lines [first, first + count) */
+    int count;
+    unsigned short *offs;         /* line starts in the decoded block */
+    unsigned long long mask;      /* OR of the lines' mmenu_charmask() */
+} zc_block;
 
-    while (fgets(buf, sizeof(buf), stdin)) {
+typedef struct {
+    zc_block *blocks;
+    int nblocks, blocks_cap;
+    long long count;
+    size_t raw_bytes, comp_bytes;
+
+    /* block being filled */
+    char stage[ZC_BLOCK];
+    size_t stage_len;
+    unsigned short *stage_offs;
+    int stage_count, stage_cap;
+    unsigned long long stage_mask;
+
+    /* display cache: decoded blocks, least recently used evicted */
+    int cache_block[ZC_CACHE];
+    unsigned long cache_used[ZC_CACHE];
+    char *cache_raw[ZC_CACHE];
+    unsigned long clock;
+
+    int threads;
+    filt *res;                    /* per-block scan results, allocated on first hit */
+} zc_t;
+
+static void zc_seal(zc_t *z) {
+    if (!z->stage_count) return;
+    if (z->nblocks == z->blocks_cap) {
+        z->blocks_cap = z->blocks_cap ? z->blocks_cap * 2 : 64;
+        z->blocks = realloc(z->blocks, (size_t)z->blocks_cap * sizeof(zc_block));
+        if (!z->blocks) { perror("realloc"); exit(1); }
+    }
+    unsigned char tmp[ZC_BLOCK + ZC_BLOCK / 255 + 16];
+    size_t clen = lz_compress((const unsigned char *)z->stage, z->stage_len, tmp);
+    zc_block *b = &z->blocks[z->nblocks++];
+    b->data = malloc(clen);
+    b->offs = malloc((size_t)z->stage_count * sizeof(unsigned short));
+    if (!b->data || !b->offs) { perror("malloc"); exit(1); }
+    memcpy(b->data, tmp, clen);
+    memcpy(b->offs, z->stage_offs, (size_t)z->stage_count * sizeof(unsigned short));
+    b->clen = (unsigned int)clen;
+    b->rlen = (unsigned int)z->stage_len;
+    b->first = z->count - z->stage_count;
+    b->count = z->stage_count;
+    b->mask = z->stage_mask;
+    z->raw_bytes += z->stage_len;
+    z->comp_bytes += clen;
+    z->stage_len = 0;
+    z->stage_count = 0;
+    z->stage_mask = 0;
+}
+
+static void zc_push(zc_t *z, const char *s, size_t len) {
+    if (z->stage_len + len + 1 > ZC_BLOCK) zc_seal(z);
+    if (z->stage_count == z->stage_cap) {
+        z->stage_cap = z->stage_cap ? z->stage_cap * 2 : 1024;
+        z->stage_offs = realloc(z->stage_offs, (size_t)z->stage_cap * sizeof(unsigned short));
+        if (!z->stage_offs) { perror("realloc"); exit(1); }
+    }
+    z->stage_offs[z->stage_count++] = (unsigned short)z->stage_len;
+    memcpy(z->stage + z->stage_len, s, len);
+    z->stage[z->stage_len + len] = '\0';
+    z->stage_len += len + 1;
+    z->stage_mask |= mmenu_charmask(s, len);
+    z->count++;
+}
+
+static void zc_load(zc_t *z, FILE *in) {
+    char buf[LINE_BUF_SIZE];
+    while (fgets(buf, sizeof(buf), in)) {
         size_t len = strlen(buf);
         if (len > 0 && buf[len-1] == '\n') buf[--len] = '\0';
         else if (len == sizeof(buf)-1) {
             int c;
-            while ((c = getchar()) != EOF && c != '\n');
+            while ((c = getc(in)) != EOF && c != '\n');
         }
-        /* Store in chunked arena instead of per-line malloc */
-        char *stored = lines_arena_dup(&opts, buf, len);
-        lines_push(&opts, stored);
+        zc_push(z, buf, len);
+    }
+    zc_seal(z);
+    free(z->stage_offs);
+    z->stage_offs = NULL;
+    for (int k = 0; k < ZC_CACHE; k++) z->cache_block[k] = -1;
+}
+
+static void zc_decode(const zc_block *b, char *raw) {
+    if (lz_decompress(b->data, b->clen, (unsigned char *)raw, ZC_BLOCK) != b->rlen) {
+        fprintf(stderr, "mmenu: corrupt compressed block\n");
+        exit(1);
+    }
+}
+
+static int zc_find(const zc_t *z, long long i) {
+    int lo = 0, hi = z->nblocks;
+    while (hi - lo > 1) {
+        int mid = lo + (hi - lo) / 2;
+        if (z->blocks[mid].first <= i) lo = mid; else hi = mid;
+    }
+    return lo;
+}
+
+/* Row i through the display cache (menu thread only). */
+static const char *zc_line(zc_t *z, long long i) {
+    int b = zc_find(z, i), slot = 0;
+    for (int k = 0; k < ZC_CACHE; k++) {
+        if (z->cache_block[k] == b) { slot = k; goto hit; }
+        if (z->cache_used[k] < z->cache_used[slot]) slot = k;
+    }
+    if (!z->cache_raw[slot] && !(z->cache_raw[slot] = malloc(ZC_BLOCK))) { perror("malloc"); exit(1); }
+    zc_decode(&z->blocks[b], z->cache_raw[slot]);
+    z->cache_block[slot] = b;
+hit:
+    z->cache_used[slot] = ++z->clock;
+    return z->cache_raw[slot] + z->blocks[b].offs[i - z->blocks[b].first];
+}
+
+typedef struct {
+    zc_t *z;
+    const char *q;
+    unsigned long long qmask;
+    long long from, to;
+    int b_lo, b_hi;
+    int next;                     /* next block to claim (atomic) */
+} zc_scan_t;
+
+static void *zc_scan_worker(void *arg) {
+    zc_scan_t *s = arg;
+    zc_t *z = s->z;
+    char *raw = malloc(ZC_BLOCK);
+    if (!raw) { perror("malloc"); exit(1); }
+    for (;;) {
+        int bi = s->b_lo + __atomic_fetch_add(&s->next, 1, __ATOMIC_RELAXED);
+        if (bi >= s->b_hi) break;
+        const zc_block *b = &z->blocks[bi];
+        if ((b->mask & s->qmask) != s->qmask) continue;
+        zc_decode(b, raw);
+        int lo = s->from > b->first ? (int)(s->from - b->first) : 0;
+        int hi = s->to < b->first + b->count ? (int)(s->to - b->first) : b->count;
+        for (int j = lo; j < hi; j++) {
+            const char *line = raw + b->offs[j];
+            const char *m = strcasestr(line, s->q);
+            if (!m) continue;
+            filt *r = &z->res[bi];
+            if (!r->indices) { filt_init(r); r->universe = LLONG_MAX; }   /* keep it a list */
+            filt_push(r, b->first + j, (int)(m - line));
+        }
+    }
+    free(raw);
+    return NULL;
+}
+
+/* Report the rows in [from, to) containing q, in order, with match offsets. */
+static void zc_scan(zc_t *z, const char *q, long long from, long long to,
+                    void (*hit)(void *ctx, long long i, int off), void *ctx) {
+    if (from >= to) return;
+    zc_scan_t s = { z, q, mmenu_charmask(q, strlen(q)), from, to,
+                    zc_find(z, from), zc_find(z, to - 1) + 1, 0 };
+    if (!z->res && !(z->res = calloc((size_t)z->nblocks, sizeof(filt)))) { perror("calloc"); exit(1); }
+    int threads = z->threads;
+    if (threads > s.b_hi - s.b_lo) threads = s.b_hi - s.b_lo;
+    pthread_t *tids = threads > 1 ? malloc((size_t)threads * sizeof(pthread_t)) : NULL;
+    int started = 0;
+    for (int t = 1; tids && t < threads; t++) {
+        if (pthread_create(&tids[t], NULL, zc_scan_worker, &s) != 0) break;
+        started = t;
+    }
+    zc_scan_worker(&s);
+    for (int t = 1; t <= started; t++) pthread_join(tids[t], NULL);
+    free(tids);
+    /* Hand the hits over in block order */
+    for (int bi = s.b_lo; bi < s.b_hi; bi++) {
+        filt *r = &z->res[bi];
+        if (!r->indices) continue;
+        FILT_FOREACH(r, k, idx, off, hit(ctx, idx, off));
+        filt_free(r);
+        memset(r, 0, sizeof(*r));
+    }
+}
+
+static void zc_free(zc_t *z) {
+    for (int b = 0; b < z->nblocks; b++) {
+        free(z->blocks[b].data);
+        free(z->blocks[b].offs);
+    }
+    free(z->blocks);
+    free(z->res);
+    for (int k = 0; k < ZC_CACHE; k++) free(z->cache_raw[k]);
+}
+
+/* mmenu_vlist callbacks */
+static const char *zc_fetch(void *ud, long long i, char *buf, size_t cap) {
+    (void)buf; (void)cap;
+    return zc_line(ud, i);
+}
+
+static void zc_match(void *ud, const char *q, long long from, long long to,
+                     void (*hit)(void *ctx, long long i, int off), void *ctx) {
+    zc_scan(ud, q, from, to, hit, ctx);
+}
+
+typedef struct { zc_t *z; int output_index; FILE *out; } zc_filter_ctx;
+
+static void zc_filter_hit(void *ctx, long long i, int off) {
+    zc_filter_ctx *c = ctx;
+    (void)off;
+    if (c->output_index) fprintf(c->out, "%lld\n", i);
+    else fprintf(c->out, "%s\n", zc_line(c->z, i));
+}
+
+/* ---- Batch queries (--queries FILE) ----------------------------------------
+   One corpus load amortised over many queries. Each line of FILE is a query;
+   its 0-based line number is the query id. Worker threads pull query ids from
+   a shared counter and write their results into a private memory stream, and
+   the streams are emitted in id order once everyone is done, so the output is
+   deterministic whatever the thread count. */
+
+typedef struct {
+    const lines_t *corpus;
+    lines_t *queries;
+    int output_index;
+    int count_only;
+    char **out;        /* per-query result text */
+    size_t *out_len;
+    long *counts;
+    int next;          /* next query id to claim (atomic) */
+} batch_t;
+
+static void *batch_worker(void *arg) {
+    batch_t *b = arg;
+    for (;;) {
+        int qi = __atomic_fetch_add(&b->next, 1, __ATOMIC_RELAXED);
+        if (qi >= b->queries->count) break;
+        const char *q = b->queries->lines[qi];
+        const lines_t *c = b->corpus;
+        unsigned long long qmask = b->queries->masks[qi];
+        if (b->count_only) {
+            long n = 0;
+            MM_FOREACH_CANDIDATE(i, c->masks, c->count, qmask, {
+                if (strcasestr(c->lines[i], q)) n++;
+            });
+            b->counts[qi] = n;
+            continue;
+        }
+        FILE *f = open_memstream(&b->out[qi], &b->out_len[qi]);
+        if (!f) { perror("open_memstream"); exit(1); }
+        MM_FOREACH_CANDIDATE(i, c->masks, c->count, qmask, {
+            if (strcasestr(c->lines[i], q)) {
+                if (b->output_index) fprintf(f, "%d\t%lld\n", qi, i);
+                else fprintf(f, "%d\t%s\n", qi, c->lines[i]);
+            }
+        });
+        fclose(f);
+    }
+    return NULL;
+}
+
+static int batch_run(const lines_t *corpus, const char *path, int output_index,
+                     int count_only, int threads) {
+    FILE *qf = fopen(path, "r");
+    if (!qf) { perror(path); return 1; }
+    lines_t queries = {0};
+    lines_load(&queries, qf);
+    fclose(qf);
+
+    batch_t b = { .corpus = corpus, .queries = &queries,
+                  .output_index = output_index, .count_only = count_only };
+    int nq = (int)queries.count;
+    b.out = calloc((size_t)nq + 1, sizeof(char *));
+    b.out_len = calloc((size_t)nq + 1, sizeof(size_t));
+    b.counts = calloc((size_t)nq + 1, sizeof(long));
+    if (!b.out || !b.out_len || !b.counts) { perror("calloc"); exit(1); }
+
+    if (threads <= 0) threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads > nq) threads = nq;
+    if (threads < 1) threads = 1;
+    pthread_t *tids = malloc((size_t)threads * sizeof(pthread_t));
+    if (!tids) { perror("malloc"); exit(1); }
+    int started = 0;
+    for (int t = 1; t < threads; t++) {
+        if (pthread_create(&tids[t], NULL, batch_worker, &b) != 0) break;
+        started = t;
+    }
+    batch_worker(&b);   /* the main thread works too */
+    for (int t = 1; t <= started; t++) pthread_join(tids[t], NULL);
+    free(tids);
+
+    for (int qi = 0; qi < nq; qi++) {
+        if (count_only) printf("%d\t%ld\n", qi, b.counts[qi]);
+        else if (b.out_len[qi]) fwrite(b.out[qi], 1, b.out_len[qi], stdout);
+        free(b.out[qi]);
+    }
+    free(b.out);
+    free(b.out_len);
+    free(b.counts);
+    lines_free(&queries);
+    return 0;
+}
+
+/* ---- Multi-pattern filter (--patterns FILE) --------------------------------
+   Every line of FILE is a literal needle (empty lines are skipped but keep
+   their number as the pattern id). The needles are compiled into an
+   Aho-Corasick DFA over byte classes: bytes that occur in no pattern share
+   class 0, ASCII letters are folded, so a row of the transition table is
+   only as wide as the patterns' alphabet. Entries hold the target row's
+   offset (state * classes) with AC_HIT set when the target completes a
+   pattern, so the scan loop is one table load per input byte and stops at
+   the first hit. The cost per line does not depend on how many patterns
+   there are. Lines are split into contiguous ranges scanned by --threads
+   workers into private streams, printed in input order. */
+
+#define AC_HIT 0x80000000u
+#define AC_FOLD(c) ((c) < 128 ? tolower(c) : (c))
+
+typedef struct {
+    unsigned char cls[256];
+    int nclass;
+    unsigned *delta;       /* nstates * nclass entries */
+    int *out;              /* lowest pattern id completed in each state, -1 for none */
+    int nstates;
+} ac_t;
+
+static void ac_build(ac_t *a, const lines_t *pats) {
+    memset(a, 0, sizeof(*a));
+    int used[256] = {0};
+    size_t total = 1;
+    for (long long p = 0; p < pats->count; p++)
+        for (const unsigned char *c = (const unsigned char *)pats->lines[p]; *c; c++) {
+            used[AC_FOLD(*c)] = 1;
+            total++;
+        }
+    a->nclass = 1;
+    for (int c = 0; c < 256; c++) if (used[c]) a->cls[c] = (unsigned char)a->nclass++;
+    for (int c = 0; c < 256; c++) a->cls[c] = a->cls[AC_FOLD(c)];
+    if ((unsigned long long)total * (unsigned)a->nclass >= AC_HIT) {
+        fprintf(stderr, "--patterns: automaton too large\n");
+        exit(1);
+    }
+
+    /* Trie first; 0 in delta means "no edge" (the root is never a child) */
+    int C = a->nclass;
+    a->delta = calloc(total * (size_t)C, sizeof(unsigned));
+    a->out = malloc(total * sizeof(int));
+    int *fail = calloc(total, sizeof(int));
+    int *queue = malloc(total * sizeof(int));
+    if (!a->delta || !a->out || !fail || !queue) { perror("malloc"); exit(1); }
+    a->out[0] = -1;
+    a->nstates = 1;
+    for (long long p = 0; p < pats->count; p++) {
+        const unsigned char *c = (const unsigned char *)pats->lines[p];
+        if (!*c) continue;
+        int s = 0;
+        for (; *c; c++) {
+            unsigned *e = &a->delta[(size_t)s * C + a->cls[*c]];
+            if (!*e) { *e = (unsigned)a->nstates; a->out[a->nstates++] = -1; }
+            s = (int)*e;
+        }
+        if (a->out[s] < 0) a->out[s] = (int)p;
+    }
+
+    /* Breadth-first: fail links, inherited outputs, missing edges filled in */
+    int head = 0, tail = 0;
+    for (int c = 0; c < C; c++) if (a->delta[c]) queue[tail++] = (int)a->delta[c];
+    while (head < tail) {
+        int s = queue[head++];
+        int f = fail[s];
+        if (a->out[f] >= 0 && (a->out[s] < 0 || a->out[f] < a->out[s])) a->out[s] = a->out[f];
+        for (int c = 0; c < C; c++) {
+            unsigned *e = &a->delta[(size_t)s * C + c];
+            unsigned via = a->delta[(size_t)f * C + c];
+            if (*e) { fail[*e] = (int)via; queue[tail++] = (int)*e; }
+            else *e = via;
+        }
+    }
+    free(fail);
+    free(queue);
+
+    /* Pre-multiply targets and flag accepting ones */
+    for (size_t i = 0; i < (size_t)a->nstates * C; i++) {
+        unsigned t = a->delta[i];
+        a->delta[i] = t * (unsigned)C | (a->out[t] >= 0 ? AC_HIT : 0);
+    }
+}
+
+/* Id of the pattern that completes first in s, or -1. */
+static int ac_match(const ac_t *a, const char *s) {
+    const unsigned *d = a->delta;
+    unsigned row = 0;
+    for (const unsigned char *p = (const unsigned char *)s; *p; p++) {
+        row = d[row + a->cls[*p]];
+        if (row & AC_HIT) return a->out[(row & ~AC_HIT) / (unsigned)a->nclass];
+    }
+    return -1;
+}
+
+static void ac_free(ac_t *a) { free(a->delta); free(a->out); }
+
+typedef struct {
+    const ac_t *ac;
+    const lines_t *corpus;
+    long long from, to;
+    int output_index, which, count_only;
+    char *out; size_t out_len;
+    long long n;
+} ac_part;
+
+static void *ac_worker(void *arg) {
+    ac_part *w = arg;
+    const lines_t *c = w->corpus;
+    FILE *f = w->count_only ? NULL : open_memstream(&w->out, &w->out_len);
+    if (!w->count_only && !f) { perror("open_memstream"); exit(1); }
+    for (long long i = w->from; i < w->to; i++) {
+        int p = ac_match(w->ac, c->lines[i]);
+        if (p < 0) continue;
+        w->n++;
+        if (!f) continue;
+        if (w->which) fprintf(f, "%d\t", p);
+        if (w->output_index) fprintf(f, "%lld\n", i);
+        else fprintf(f, "%s\n", c->lines[i]);
+    }
+    if (f) fclose(f);
+    return NULL;
+}
+
+static int patterns_run(const lines_t *corpus, const char *path, int output_index, int which,
+                        int count_only, int threads) {
+    FILE *pf = fopen(path, "r");
+    if (!pf) { perror(path); return 1; }
+    lines_t pats = {0};
+    lines_load(&pats, pf);
+    fclose(pf);
+    ac_t ac;
+    ac_build(&ac, &pats);
+    lines_free(&pats);
+
+    if (threads <= 0) threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads > corpus->count / 4096) threads = (int)(corpus->count / 4096);
+    if (threads < 1) threads = 1;
+    ac_part *parts = calloc((size_t)threads, sizeof(ac_part));
+    pthread_t *tids = malloc((size_t)threads * sizeof(pthread_t));
+    char *started = calloc((size_t)threads, 1);
+    if (!parts || !tids || !started) { perror("malloc"); exit(1); }
+    for (int t = 0; t < threads; t++)
+        parts[t] = (ac_part){ .ac = &ac, .corpus = corpus, .output_index = output_index,
+                              .which = which, .count_only = count_only,
+                              .from = corpus->count * t / threads,
+                              .to = corpus->count * (t + 1) / threads };
+    for (int t = 1; t < threads; t++)
+        started[t] = pthread_create(&tids[t], NULL, ac_worker, &parts[t]) == 0;
+    ac_worker(&parts[0]);
+    for (int t = 1; t < threads; t++) {
+        if (started[t]) pthread_join(tids[t], NULL);
+        else ac_worker(&parts[t]);
+    }
+
+    long long n = 0;
+    for (int t = 0; t < threads; t++) {
+        n += parts[t].n;
+        if (parts[t].out_len) fwrite(parts[t].out, 1, parts[t].out_len, stdout);
+        free(parts[t].out);
+    }
+    if (count_only) printf("%lld\n", n);
+    free(parts);
+    free(tids);
+    free(started);
+    ac_free(&ac);
+    return 0;
+}
+
+/* ---- Live tail (--watch FILE) ----------------------------------------------
+   The file is read once up front, then followed through inotify: appends are
+   read from the last offset, a shrinking size means truncation (start over at
+   0), and a new inode behind the path means rotation (finish the old file,
+   then switch). Existing lines are never rescanned; the menu only matches the
+   lines each poll appends. An unterminated last line waits for its newline. */
+
+typedef struct {
+    const char *path;
+    lines_t *lines;
+    int fd;
+    ino_t ino;
+    off_t off;
+    int ino_fd;            /* inotify instance */
+    int wd_file, wd_dir;
+    char partial[LINE_BUF_SIZE];
+    size_t plen;
+} watch_t;
+
+static void watch_add_line(watch_t *w, const char *s, size_t n) {
+    if (w->plen) {
+        /* Join with the piece left over from the previous read (truncated like lines_load) */
+        size_t room = sizeof(w->partial) - 1 - w->plen;
+        if (n > room) n = room;
+        memcpy(w->partial + w->plen, s, n);
+        s = w->partial;
+        n += w->plen;
+        w->plen = 0;
+    } else if (n > LINE_BUF_SIZE - 1) {
+        n = LINE_BUF_SIZE - 1;
+    }
+    lines_push(w->lines, lines_arena_dup(w->lines, s, n), n);
+}
+
+/* Read everything appended since the last call. Returns lines added. */
+static long long watch_read(watch_t *w) {
+    long long before = w->lines->count;
+    char buf[64 * 1024];
+    for (;;) {
+        ssize_t r = pread(w->fd, buf, sizeof(buf), w->off);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) break;
+        w->off += r;
+        const char *p = buf, *end = buf + r;
+        const char *nl;
+        while ((nl = memchr(p, '\n', (size_t)(end - p)))) {
+            watch_add_line(w, p, (size_t)(nl - p));
+            p = nl + 1;
+        }
+        size_t rest = (size_t)(end - p);
+        if (rest > sizeof(w->partial) - 1 - w->plen) rest = sizeof(w->partial) - 1 - w->plen;
+        memcpy(w->partial + w->plen, p, rest);
+        w->plen += rest;
+    }
+    return w->lines->count - before;
+}
+
+static int watch_open(watch_t *w) {
+    w->fd = open(w->path, O_RDONLY | O_CLOEXEC);
+    if (w->fd < 0) return -1;
+    struct stat st;
+    fstat(w->fd, &st);
+    w->ino = st.st_ino;
+    w->off = 0;
+    w->plen = 0;
+    if (w->ino_fd >= 0) {
+        if (w->wd_file >= 0) inotify_rm_watch(w->ino_fd, w->wd_file);
+        w->wd_file = inotify_add_watch(w->ino_fd, w->path, IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+    }
+    return 0;
+}
+
+static int watch_init(watch_t *w, const char *path, lines_t *lines) {
+    memset(w, 0, sizeof(*w));
+    w->path = path;
+    w->lines = lines;
+    w->wd_file = w->wd_dir = -1;
+    w->ino_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (w->ino_fd < 0) { perror("inotify_init1"); return -1; }
+    if (watch_open(w) < 0) { perror(path); return -1; }
+
+    /* Watch the directory too, so a rotated-in file with our name is noticed */
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", path);
+    char *slash = strrchr(dir, '/');
+    if (slash == dir) slash[1] = '\0';
+    else if (slash) *slash = '\0';
+    else strcpy(dir, ".");
+    w->wd_dir = inotify_add_watch(w->ino_fd, dir, IN_CREATE | IN_MOVED_TO);
+
+    watch_read(w);
+    return 0;
+}
+
+/* mmenu_opts.feed: drain inotify, then pick up appends, truncation and rotation. */
+static int watch_feed(void *ud, const char *const **options, const unsigned long long **masks,
+                      long long *n_options) {
+    watch_t *w = ud;
+    char ev[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int events = 0;
+    while (read(w->ino_fd, ev, sizeof(ev)) > 0) events = 1;
+    if (!events) return 0;
+
+    long long added = 0;
+    if (w->fd >= 0) {
+        struct stat st;
+        if (fstat(w->fd, &st) == 0 && st.st_size < w->off) {
+            w->off = 0;       /* truncated: whatever is there now is new */
+            w->plen = 0;
+        }
+        added += watch_read(w);
+    }
+    struct stat pst;
+    if (stat(w->path, &pst) == 0 && (w->fd < 0 || pst.st_ino != w->ino)) {
+        /* Rotated: the old file has been drained above, switch to the new one */
+        if (w->fd >= 0) close(w->fd);
+        if (w->plen) watch_add_line(w, "", 0), added++;
+        if (watch_open(w) == 0) added += watch_read(w);
+    }
+    if (!added) return 0;
+    *options = (const char *const *)w->lines->lines;
+    *masks = w->lines->masks;
+    *n_options = w->lines->count;
+    return 1;
+}
+
+static void watch_close(watch_t *w) {
+    if (w->fd >= 0) close(w->fd);
+    if (w->ino_fd >= 0) close(w->ino_fd);
+}
+
+/* ---- Built-in directory walker (--walk DIR) --------------------------------
+   Replaces `find DIR | mmenu`: no second process, no pipe, no re-parsing.
+   Every worker owns a deque of directories to read. It pushes the
+   subdirectories it finds and pops its own newest work (depth first, warm
+   dentries); an idle worker steals the oldest entry of another deque, which
+   tends to be the biggest unexplored subtree. Directories are read with
+   getdents64 into a large buffer and d_type avoids a stat per entry. A
+   directory with subdirectories keeps its descriptor open until the last of
+   them is opened relative to it (openat on the entry name), so the kernel
+   never re-resolves a full path; past a budget of open descriptors new
+   parents close theirs and their children fall back to full paths. Idle
+   workers sleep on a condition variable until work is pushed or the walk
+   ends.
+
+   Workers never touch the menu's line table: finished paths are appended to
+   a shared staging buffer, and the feed callback (run by the menu thread
+   while idle) moves them into the arena, so results show up while the walk
+   is still going. Every non-directory entry is listed; symlinks are not
+   followed. */
+
+#define WALK_BUF (64 * 1024)
+
+struct walk_dirent64 {
+    unsigned long long d_ino;
+    long long d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+/* Open directory shared by its queued subdirectories. */
+typedef struct { int fd; int refs; } walk_node;
+
+typedef struct {
+    char *path;
+    int depth;
+    size_t name_off;            /* entry name within path */
+    walk_node *parent;          /* NULL: open by full path */
+} walk_dir;
+
+typedef struct {
+    pthread_mutex_t mu;
+    walk_dir *items;
+    int head, tail, cap;
+} walk_deque;
+
+typedef struct {
+    /* options */
+    int max_depth;              /* 0 = unlimited; entries of DIR are depth 1 */
+    int one_fs;                 /* do not descend into other filesystems */
+    dev_t root_dev;
+    const char **ignore;        /* fnmatch() patterns on entry names */
+    int n_ignore;
+
+    int nthreads;
+    walk_deque *dq;
+    pthread_t *tids;
+    int pending;                /* directories queued or being read (atomic) */
+    int stop;                   /* set to abandon the walk (atomic) */
+    int open_fds, fd_budget;    /* parent descriptors held open (atomic) */
+    pthread_mutex_t idle_mu;
+    pthread_cond_t idle_cv;     /* work pushed, walk done or stopped */
+    int idle;                   /* workers waiting on idle_cv */
+
+    /* Staging area between workers and the feed: NUL-separated paths */
+    pthread_mutex_t out_mu;
+    char *out, *spare;
+    size_t out_len, out_cap, spare_cap;
+    lines_t *lines;
+} walk_t;
+
+static void walk_unref(walk_t *w, walk_node *n) {
+    if (!n || __atomic_sub_fetch(&n->refs, 1, __ATOMIC_ACQ_REL)) return;
+    close(n->fd);
+    __atomic_fetch_sub(&w->open_fds, 1, __ATOMIC_RELAXED);
+    free(n);
+}
+
+static void walk_wake(walk_t *w, int all) {
+    pthread_mutex_lock(&w->idle_mu);
+    if (all) pthread_cond_broadcast(&w->idle_cv);
+    else if (w->idle) pthread_cond_signal(&w->idle_cv);
+    pthread_mutex_unlock(&w->idle_mu);
+}
+
+static void walk_push(walk_t *w, int t, walk_dir dir) {
+    walk_deque *d = &w->dq[t];
+    __atomic_fetch_add(&w->pending, 1, __ATOMIC_RELAXED);
+    if (dir.parent) __atomic_fetch_add(&dir.parent->refs, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&d->mu);
+    if (d->head == d->tail) d->head = d->tail = 0;
+    if (d->tail == d->cap) {
+        d->cap = d->cap ? d->cap * 2 : 64;
+        d->items = realloc(d->items, (size_t)d->cap * sizeof(walk_dir));
+        if (!d->items) { perror("realloc"); exit(1); }
+    }
+    d->items[d->tail++] = dir;
+    pthread_mutex_unlock(&d->mu);
+    walk_wake(w, 0);
+}
+
+/* Own work from the back, stolen work from the front. */
+static int walk_take(walk_t *w, int t, walk_dir *out) {
+    for (int k = 0; k < w->nthreads; k++) {
+        walk_deque *d = &w->dq[(t + k) % w->nthreads];
+        pthread_mutex_lock(&d->mu);
+        int got = d->head < d->tail;
+        if (got) *out = k == 0 ? d->items[--d->tail] : d->items[d->head++];
+        pthread_mutex_unlock(&d->mu);
+        if (got) return 1;
+    }
+    return 0;
+}
+
+static void walk_emit(walk_t *w, const char *buf, size_t len) {
+    if (!len) return;
+    pthread_mutex_lock(&w->out_mu);
+    if (w->out_len + len > w->out_cap) {
+        while (w->out_len + len > w->out_cap) w->out_cap = w->out_cap ? w->out_cap * 2 : WALK_BUF;
+        w->out = realloc(w->out, w->out_cap);
+        if (!w->out) { perror("realloc"); exit(1); }
+    }
+    memcpy(w->out + w->out_len, buf, len);
+    w->out_len += len;
+    pthread_mutex_unlock(&w->out_mu);
+}
+
+static int walk_ignored(const walk_t *w, const char *name) {
+    for (int k = 0; k < w->n_ignore; k++)
+        if (!fnmatch(w->ignore[k], name, 0)) return 1;
+    return 0;
+}
+
+/* Read one directory: emit its files, queue its subdirectories. */
+static void walk_read(walk_t *w, int t, const walk_dir *dir, char *dents, char **emit, size_t *emit_cap) {
+    int fd = dir->parent
+        ? openat(dir->parent->fd, dir->path + dir->name_off, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)
+        : openat(AT_FDCWD, dir->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    walk_unref(w, dir->parent);
+    if (fd < 0) return;
+    if (w->one_fs) {
+        struct stat st;
+        if (fstat(fd, &st) < 0 || st.st_dev != w->root_dev) { close(fd); return; }
+    }
+    walk_node *self = NULL;     /* created on the first subdirectory */
+    int keep = 1;
+    size_t plen = strlen(dir->path);
+    int slash = plen > 0 && dir->path[plen - 1] == '/';
+    size_t used = 0;
+    long n;
+    while (!__atomic_load_n(&w->stop, __ATOMIC_RELAXED) &&
+           (n = syscall(SYS_getdents64, fd, dents, WALK_BUF)) > 0) {
+        for (long off = 0; off < n; ) {
+            struct walk_dirent64 *e = (struct walk_dirent64 *)(dents + off);
+            off += e->d_reclen;
+            const char *name = e->d_name;
+            if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2]))) continue;
+            if (w->n_ignore && walk_ignored(w, name)) continue;
+            size_t nlen = strlen(name);
+            size_t len = plen + !slash + nlen;
+            int type = e->d_type;
+            if (type == DT_UNKNOWN) {
+                struct stat st;
+                type = fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode) ? DT_DIR : DT_REG;
+            }
+            if (type == DT_DIR) {
+                if (w->max_depth && dir->depth + 1 >= w->max_depth) continue;
+                char *sub = malloc(len + 1);
+                if (!sub) { perror("malloc"); exit(1); }
+                memcpy(sub, dir->path, plen);
+                if (!slash) sub[plen] = '/';
+                memcpy(sub + plen + !slash, name, nlen + 1);
+                if (!self && keep) {
+                    keep = __atomic_add_fetch(&w->open_fds, 1, __ATOMIC_RELAXED) <= w->fd_budget;
+                    if (keep && !(self = malloc(sizeof(*self)))) { perror("malloc"); exit(1); }
+                    if (keep) *self = (walk_node){ fd, 1 };
+                    else __atomic_fetch_sub(&w->open_fds, 1, __ATOMIC_RELAXED);
+                }
+                walk_push(w, t, (walk_dir){ sub, dir->depth + 1, plen + !slash, self });
+                continue;
+            }
+            if (used + len + 1 > *emit_cap) {
+                while (used + len + 1 > *emit_cap) *emit_cap *= 2;
+                *emit = realloc(*emit, *emit_cap);
+                if (!*emit) { perror("realloc"); exit(1); }
+            }
+            memcpy(*emit + used, dir->path, plen);
+            if (!slash) (*emit)[used + plen] = '/';
+            memcpy(*emit + used + plen + !slash, name, nlen + 1);
+            used += len + 1;
+        }
+    }
+    if (self) walk_unref(w, self);   /* closes fd once the last child is open */
+    else close(fd);
+    walk_emit(w, *emit, used);   /* one lock per directory */
+}
+
+typedef struct { walk_t *w; int t; } walk_arg;
+
+static void *walk_worker(void *arg) {
+    walk_t *w = ((walk_arg *)arg)->w;
+    int t = ((walk_arg *)arg)->t;
+    free(arg);
+    char *dents = malloc(WALK_BUF);
+    size_t emit_cap = WALK_BUF;
+    char *emit = malloc(emit_cap);
+    if (!dents || !emit) { perror("malloc"); exit(1); }
+    walk_dir dir;
+    while (!__atomic_load_n(&w->stop, __ATOMIC_RELAXED)) {
+        int got = walk_take(w, t, &dir);
+        if (!got) {
+            pthread_mutex_lock(&w->idle_mu);
+            while (!(got = walk_take(w, t, &dir)) && !__atomic_load_n(&w->stop, __ATOMIC_RELAXED) &&
+                   __atomic_load_n(&w->pending, __ATOMIC_ACQUIRE) > 0) {
+                w->idle++;
+                pthread_cond_wait(&w->idle_cv, &w->idle_mu);
+                w->idle--;
+            }
+            pthread_mutex_unlock(&w->idle_mu);
+        }
+        if (!got) break;   /* nothing queued and nobody reading: the tree is done */
+        walk_read(w, t, &dir, dents, &emit, &emit_cap);
+        free(dir.path);
+        if (__atomic_sub_fetch(&w->pending, 1, __ATOMIC_ACQ_REL) == 0) walk_wake(w, 1);
+    }
+    free(dents);
+    free(emit);
+    return NULL;
+}
+
+static int walk_start(walk_t *w, const char *root, int threads, lines_t *lines) {
+    struct stat st;
+    if (stat(root, &st) < 0) { perror(root); return -1; }
+    w->root_dev = st.st_dev;
+    w->lines = lines;
+    if (threads <= 0) threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads < 1) threads = 1;
+    w->nthreads = threads;
+    struct rlimit rl;
+    w->fd_budget = getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY
+        ? (int)(rl.rlim_cur / 2 < 65536 ? rl.rlim_cur / 2 : 65536) : 4096;
+    w->dq = calloc((size_t)threads, sizeof(walk_deque));
+    w->tids = calloc((size_t)threads, sizeof(pthread_t));
+    if (!w->dq || !w->tids) { perror("calloc"); exit(1); }
+    for (int t = 0; t < threads; t++) pthread_mutex_init(&w->dq[t].mu, NULL);
+    pthread_mutex_init(&w->out_mu, NULL);
+    pthread_mutex_init(&w->idle_mu, NULL);
+    pthread_cond_init(&w->idle_cv, NULL);
+    walk_push(w, 0, (walk_dir){ strdup(root), 0, 0, NULL });
+    for (int t = 0; t < threads; t++) {
+        walk_arg *a = malloc(sizeof(*a));
+        if (!a) { perror("malloc"); exit(1); }
+        *a = (walk_arg){ w, t };
+        if (pthread_create(&w->tids[t], NULL, walk_worker, a) != 0) {
+            free(a);
+            if (t == 0) { perror("pthread_create"); return -1; }
+            w->tids[t] = 0;
+        }
+    }
+    return 0;
+}
+
+/* mmenu_opts.feed: move staged paths into the line table (menu thread only). */
+static int walk_feed(void *ud, const char *const **options, const unsigned long long **masks,
+                     long long *n_options) {
+    walk_t *w = ud;
+    pthread_mutex_lock(&w->out_mu);
+    char *buf = w->out;
+    size_t len = w->out_len, cap = w->out_cap;
+    w->out = w->spare; w->out_cap = w->spare_cap; w->out_len = 0;
+    pthread_mutex_unlock(&w->out_mu);
+    w->spare = buf; w->spare_cap = cap;
+    if (!len) return 0;
+    for (size_t off = 0; off < len; ) {
+        size_t n = strlen(buf + off);
+        size_t keep = n < LINE_BUF_SIZE ? n : LINE_BUF_SIZE - 1;
+        lines_push(w->lines, lines_arena_dup(w->lines, buf + off, keep), keep);
+        off += n + 1;
+    }
+    *options = (const char *const *)w->lines->lines;
+    *masks = w->lines->masks;
+    *n_options = w->lines->count;
+    return 1;
+}
+
+/* Wait for the walk to finish (or, with abandon, stop it early) and reap the workers. */
+static void walk_finish(walk_t *w, int abandon) {
+    if (abandon) {
+        __atomic_store_n(&w->stop, 1, __ATOMIC_RELAXED);
+        walk_wake(w, 1);
+    }
+    for (int t = 0; t < w->nthreads; t++)
+        if (w->tids[t]) pthread_join(w->tids[t], NULL);
+    for (int t = 0; t < w->nthreads; t++) {
+        walk_deque *d = &w->dq[t];
+        for (int k = d->head; k < d->tail; k++) {
+            walk_unref(w, d->items[k].parent);
+            free(d->items[k].path);
+        }
+        free(d->items);
+        pthread_mutex_destroy(&d->mu);
+    }
+    free(w->dq);
+    free(w->tids);
+    pthread_mutex_destroy(&w->idle_mu);
+    pthread_cond_destroy(&w->idle_cv);
+    w->nthreads = 0;
+}
+
+static void walk_free(walk_t *w) {
+    free(w->out);
+    free(w->spare);
+    pthread_mutex_destroy(&w->out_mu);
+}
+
+/* ---- Resident daemon (--daemon / --client) ---------------------------------
+   The daemon keeps named corpora loaded (arena + line table) and answers
+   requests on a SOCK_SEQPACKET Unix socket, one message per request:
+   the op and its arguments as consecutive nul-terminated strings, with at
+   most one file descriptor attached.
+
+     load NAME        + fd to read lines from   -> "ok COUNT"
+     filter NAME Q T  (T = "1" for indices)     -> "ok COUNT" + memfd with the output
+     menu NAME PROMPT T PREVIEW ENV... + tty fd -> "ok INDEX\0LINE" or "ok -1"
+     list                                       -> "ok" NAME\0COUNT\0 ...
+     drop NAME / stop                           -> "ok"
+
+   Data never travels through the socket: the client hands over its stdin
+   or tty, and filter output comes back as a memfd the client splices to
+   stdout. Interactive sessions run in a forked child so the corpus is
+   shared copy-on-write and the daemon keeps serving other clients. The
+   terminal type and locale are the client's: "menu" carries them as
+   NAME=VALUE fields (ENV) that the child installs before opening the tty.
+
+   Loads read the client's pipe on their own thread into a private line
+   table, so a large load does not hold up other clients; the table is
+   swapped in under corpora_lock (which every other request holds while it
+   runs) and the previous contents of that name stay served until then. */
+
+#define DAEMON_MSG_MAX (64 * 1024)
+#define DAEMON_FIELDS 16
+
+/* Client environment a menu session depends on. */
+static const char *const client_env[] = { "TERM", "LANG", "LC_ALL", "LC_CTYPE", "LC_COLLATE" };
+#define CLIENT_ENV_N (int)(sizeof(client_env) / sizeof(client_env[0]))
+
+typedef struct { char *name; lines_t lines; } corpus_t;
+
+static corpus_t *corpora;
+static size_t daemon_max_memory;   /* per-corpus budget for loads */
+static int corpora_count, corpora_cap;
+static int daemon_stopping;        /* set on "stop": loads still running are discarded */
+static pthread_mutex_t corpora_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static corpus_t *corpus_find(const char *name) {
+    for (int i = 0; i < corpora_count; i++)
+        if (!strcmp(corpora[i].name, name)) return &corpora[i];
+    return NULL;
+}
+
+static int msg_send(int sock, const char *data, size_t len, int fd) {
+    struct iovec iov = { (void *)data, len };
+    union { struct cmsghdr h; char buf[CMSG_SPACE(sizeof(int))]; } ctl;
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (fd >= 0) {
+        memset(&ctl, 0, sizeof(ctl));
+        msg.msg_control = ctl.buf;
+        msg.msg_controllen = sizeof(ctl.buf);
+        struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type = SCM_RIGHTS;
+        c->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(c), &fd, sizeof(int));
+    }
+    return sendmsg(sock, &msg, 0) < 0 ? -1 : 0;
+}
+
+/* Receive one message into buf (nul-terminated); *fd gets an attached
+   descriptor or -1. Returns the payload length or -1. */
+static ssize_t msg_recv(int sock, char *buf, size_t cap, int *fd) {
+    struct iovec iov = { buf, cap - 1 };
+    union { struct cmsghdr h; char buf[CMSG_SPACE(sizeof(int))]; } ctl;
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+    *fd = -1;
+    ssize_t n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    if (n < 0) return -1;
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c))
+        if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS)
+            memcpy(fd, CMSG_DATA(c), sizeof(int));
+    buf[n] = '\0';
+    return n;
+}
+
+/* Split a request payload into its nul-separated fields. */
+static int msg_fields(char *buf, ssize_t len, const char **f, int max) {
+    int n = 0;
+    for (char *p = buf; p < buf + len && n < max; p += strlen(p) + 1) f[n++] = p;
+    return n;
+}
+
+static int reply(int sock, const char *text, int fd) {
+    return msg_send(sock, text, strlen(text) + 1, fd);
+}
+
+static void daemon_menu(int sock, corpus_t *c, const char **f, int nf, int ttyfd) {
+    signal(SIGCHLD, SIG_DFL);   /* preview children are waited for explicitly */
+    for (int i = 0; i < CLIENT_ENV_N; i++) unsetenv(client_env[i]);
+    for (int i = 5; i < nf; i++) {
+        const char *eq = strchr(f[i], '=');
+        if (!eq) continue;
+        for (int j = 0; j < CLIENT_ENV_N; j++)
+            if ((size_t)(eq - f[i]) == strlen(client_env[j]) && !strncmp(f[i], client_env[j], (size_t)(eq - f[i])))
+                setenv(client_env[j], eq + 1, 1);
+    }
+    FILE *tty = fdopen(ttyfd, "r+");
+    if (!tty) { reply(sock, "err cannot open tty", -1); exit(1); }
+    /* mmenu_ex64 reports a terminal it cannot drive as a cancel; probe
+       first so the client hears why instead of getting an empty line */
+    SCREEN *probe = newterm(NULL, tty, tty);
+    if (!probe) {
+        char msg[160];
+        snprintf(msg, sizeof(msg), "err cannot initialise terminal (TERM=%.64s)",
+                 getenv("TERM") ? getenv("TERM") : "");
+        reply(sock, msg, -1);
+        exit(1);
     }
+    endwin();
+    delscreen(probe);
+    mmenu_opts mo = {0};
+    mo.tty = tty;
+    mo.masks = c->lines.masks;
+    mo.flags = c->lines.flags;
+    if (nf > 4 && f[4][0]) mo.preview_cmd = f[4];
+    long long chosen = mmenu_ex64((const char *const *)c->lines.lines, c->lines.count, f[2], &mo);
+    char *out = malloc(DAEMON_MSG_MAX);
+    if (!out) exit(1);
+    int n = snprintf(out, DAEMON_MSG_MAX, "ok %lld", chosen) + 1;
+    if (chosen >= 0) n += snprintf(out + n, DAEMON_MSG_MAX - n, "%s", c->lines.lines[chosen]) + 1;
+    msg_send(sock, out, (size_t)n, -1);
+    exit(0);
+}
+
+typedef struct { char *name; int fd, sock; } load_job;
+
+/* Load thread: read the client's pipe into a fresh line table, then
+   publish it under the name (replacing any previous corpus) and reply. */
+static void *daemon_load(void *arg) {
+    load_job *j = arg;
+    lines_t l = {0};
+    char out[64];
+    l.max_memory = daemon_max_memory;
+    FILE *in = fdopen(j->fd, "r");
+    if (in) { lines_load(&l, in); fclose(in); }
+    else close(j->fd);
+    long long count = l.count;
+
+    pthread_mutex_lock(&corpora_lock);
+    int stopping = daemon_stopping;
+    corpus_t *c = stopping ? NULL : corpus_find(j->name);
+    if (stopping) {
+        lines_free(&l);
+    } else if (c) {
+        lines_free(&c->lines);
+        c->lines = l;
+    } else {
+        if (corpora_count == corpora_cap) {
+            corpora_cap = corpora_cap ? corpora_cap * 2 : 4;
+            corpora = realloc(corpora, corpora_cap * sizeof(corpus_t));
+            if (!corpora) { perror("realloc"); exit(1); }
+        }
+        c = &corpora[corpora_count++];
+        c->name = j->name;
+        j->name = NULL;
+        c->lines = l;
+    }
+    pthread_mutex_unlock(&corpora_lock);
+
+    if (stopping) snprintf(out, sizeof(out), "err daemon stopping");
+    else snprintf(out, sizeof(out), "ok %lld", count);
+    reply(j->sock, out, -1);
+    close(j->sock);
+    free(j->name);
+    free(j);
+    return NULL;
+}
 
+static int daemon_request(int sock, const char **f, int nf, int fd);
+
+/* Handle one request. Returns 0 to keep serving, 1 on "stop". */
+static int daemon_handle(int sock) {
+    static char buf[DAEMON_MSG_MAX];
+    int fd;
+    ssize_t len = msg_recv(sock, buf, sizeof(buf), &fd);
+    if (len <= 0) { if (fd >= 0) close(fd); return 0; }
+    const char *f[DAEMON_FIELDS];
+    int nf = msg_fields(buf, len, f, DAEMON_FIELDS);
+
+    if (!strcmp(f[0], "load") && nf > 1 && fd >= 0) {
+        load_job *j = malloc(sizeof(load_job));
+        pthread_t tid;
+        if (j) {
+            j->name = strdup(f[1]);
+            j->fd = fd;
+            j->sock = dup(sock);
+        }
+        if (!j || !j->name || j->sock < 0 || pthread_create(&tid, NULL, daemon_load, j) != 0) {
+            reply(sock, "err cannot start load", -1);
+            close(fd);
+            if (j) { if (j->sock >= 0) close(j->sock); free(j->name); free(j); }
+            return 0;
+        }
+        pthread_detach(tid);
+        return 0;
+    }
+    if (fd >= 0 && strcmp(f[0], "menu")) close(fd);
+
+    pthread_mutex_lock(&corpora_lock);
+    int stop = daemon_request(sock, f, nf, fd);
+    pthread_mutex_unlock(&corpora_lock);
+    return stop;
+}
+
+/* Serve one request other than "load"; called with corpora_lock held. */
+static int daemon_request(int sock, const char **f, int nf, int fd) {
+    corpus_t *c = nf > 1 ? corpus_find(f[1]) : NULL;
+    char out[256];
+    if (!strcmp(f[0], "filter") && nf > 3) {
+        if (!c) { reply(sock, "err no such corpus", -1); return 0; }
+        int mfd = memfd_create("mmenu-result", MFD_CLOEXEC);
+        FILE *res = mfd >= 0 ? fdopen(dup(mfd), "w") : NULL;
+        if (!res) { reply(sock, "err memfd", -1); if (mfd >= 0) close(mfd); return 0; }
+        long n = filter_write(&c->lines, f[2], f[3][0] == '1', 0, res);
+        fclose(res);
+        snprintf(out, sizeof(out), "ok %ld", n);
+        reply(sock, out, mfd);
+        close(mfd);
+    } else if (!strcmp(f[0], "menu") && nf > 3) {
+        if (!c || fd < 0) { reply(sock, c ? "err no tty" : "err no such corpus", -1); if (fd >= 0) close(fd); return 0; }
+        pid_t pid = fork();
+        if (pid == 0) daemon_menu(sock, c, f, nf, fd);
+        if (pid < 0) reply(sock, "err fork failed", -1);
+        close(fd);
+    } else if (!strcmp(f[0], "list")) {
+        static char buf[DAEMON_MSG_MAX];
+        size_t n = (size_t)snprintf(buf, sizeof(buf), "ok") + 1;
+        for (int i = 0; i < corpora_count && n + 160 < sizeof(buf); i++)
+            n += (size_t)snprintf(buf + n, sizeof(buf) - n, "%.*s%c%lld", 128, corpora[i].name,
+                                  '\0', corpora[i].lines.count) + 1;
+        msg_send(sock, buf, n, -1);
+    } else if (!strcmp(f[0], "drop") && nf > 1) {
+        if (c) {
+            lines_free(&c->lines);
+            free(c->name);
+            *c = corpora[--corpora_count];
+        }
+        reply(sock, "ok", -1);
+    } else if (!strcmp(f[0], "stop")) {
+        daemon_stopping = 1;
+        reply(sock, "ok", -1);
+        return 1;
+    } else {
+        reply(sock, "err bad request", -1);
+    }
+    return 0;
+}
+
+static int daemon_run(const char *path, size_t max_memory) {
+    daemon_max_memory = max_memory;
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) { fprintf(stderr, "socket path too long\n"); return 1; }
+    strcpy(addr.sun_path, path);
+
+    int sfd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sfd < 0) { perror("socket"); return 1; }
+    unlink(path);
+    if (bind(sfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) { perror("bind"); return 1; }
+    if (listen(sfd, 16) < 0) { perror("listen"); return 1; }
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGCHLD, SIG_IGN);   /* menu sessions reap themselves */
+
+    int stop = 0;
+    while (!stop) {
+        int c = accept(sfd, NULL, NULL);
+        if (c < 0) { if (errno == EINTR) continue; perror("accept"); break; }
+        stop = daemon_handle(c);
+        close(c);
+    }
+    close(sfd);
+    unlink(path);
+    pthread_mutex_lock(&corpora_lock);
+    for (int i = 0; i < corpora_count; i++) { lines_free(&corpora[i].lines); free(corpora[i].name); }
+    free(corpora);
+    corpora = NULL;
+    corpora_count = 0;
+    pthread_mutex_unlock(&corpora_lock);
+    return 0;
+}
+
+/* Client side: send one request and print the answer. */
+static int client_run(const char *path, const char *op, const char **args, int nargs,
+                      int fd, int output_index) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) { fprintf(stderr, "socket path too long\n"); return 1; }
+    strcpy(addr.sun_path, path);
+    int s = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (s < 0) { perror("socket"); return 1; }
+    if (connect(s, (struct sockaddr *)&addr, sizeof(addr)) < 0) { perror("connect"); return 1; }
+
+    static char buf[DAEMON_MSG_MAX];
+    size_t n = (size_t)snprintf(buf, sizeof(buf), "%s", op) + 1;
+    for (int i = 0; i < nargs; i++) {
+        size_t al = strlen(args[i]) + 1;
+        if (n + al > sizeof(buf)) { fprintf(stderr, "request too long\n"); return 1; }
+        memcpy(buf + n, args[i], al);
+        n += al;
+    }
+    if (msg_send(s, buf, n, fd) < 0) { perror("sendmsg"); return 1; }
+
+    int rfd;
+    ssize_t len = msg_recv(s, buf, sizeof(buf), &rfd);
+    close(s);
+    if (len <= 0) { fprintf(stderr, "daemon closed the connection\n"); return 1; }
+    if (strncmp(buf, "ok", 2)) { fprintf(stderr, "mmenu daemon: %s\n", buf); return 1; }
+
+    if (!strcmp(op, "filter") && rfd >= 0) {
+        /* Results live in the daemon's memfd; splice them straight to stdout */
+        struct stat st;
+        off_t off = 0;
+        fflush(stdout);
+        if (fstat(rfd, &st) == 0) {
+            while (off < st.st_size) {
+                ssize_t w = sendfile(STDOUT_FILENO, rfd, &off, (size_t)(st.st_size - off));
+                if (w <= 0) break;
+            }
+            /* sendfile refuses some targets (e.g. O_APPEND files); copy the rest */
+            char *map = off < st.st_size ? mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, rfd, 0) : MAP_FAILED;
+            if (map != MAP_FAILED) {
+                fwrite(map + off, 1, (size_t)(st.st_size - off), stdout);
+                munmap(map, (size_t)st.st_size);
+            }
+        }
+        close(rfd);
+    } else if (!strcmp(op, "menu")) {
+        long long chosen = atoll(buf + 3);
+        if (chosen < 0) printf("\n");
+        else if (output_index) printf("%lld\n", chosen);
+        else printf("%s\n", buf + strlen(buf) + 1);
+    } else if (!strcmp(op, "list")) {
+        const char *f[2 * 1024 + 1];
+        int nf = msg_fields(buf, len, f, 2 * 1024 + 1);
+        for (int i = 1; i + 1 < nf; i += 2) printf("%s\t%s\n", f[i], f[i + 1]);
+    } else if (!strcmp(op, "load")) {
+        fprintf(stderr, "%s lines\n", buf + 3);
+    }
+    if (rfd >= 0 && strcmp(op, "filter")) close(rfd);
+    return 0;
+}
+
+int main(int argc, char **argv) {
     /* Non-interactive fast path: mmenu --filter "query"  (or -f)
        Outputs matching lines (or indices with -t). Perfect for scripting
        and for isolated matcher benchmarks. No ncurses, very fast. */
     const char *filter_query = NULL;
     int output_index = 0;
     const char *prompt = "> ";
+    mmenu_opts mopts = {0};
+    const char *daemon_sock = NULL, *client_sock = NULL, *client_op = NULL;
+    const char *corpus = "default";
+    size_t max_memory = 0;
+    const char *queries_file = NULL;
+    const char *patterns_file = NULL;
+    int which = 0;
+    const char *watch_path = NULL;
+    int paths = 0, compress = 0;
+    const char *walk_root = NULL;
+    walk_t walk = {0};
+    const char **ignore = calloc((size_t)argc, sizeof(char *));
+    if (!ignore) { perror("calloc"); return 1; }
+    int count_only = 0, threads = 0;
     for (int i = 1; i < argc; i++) {
         if (!strcmp(argv[i], "--filter") || !strcmp(argv[i], "-f")) {
             if (i + 1 < argc) filter_query = argv[++i];
+        } else if (!strcmp(argv[i], "--preview")) {
+            if (i + 1 < argc) mopts.preview_cmd = argv[++i];
+        } else if (!strcmp(argv[i], "--source-cmd")) {
+            if (i + 1 < argc) mopts.source_cmd = argv[++i];
+        } else if (!strncmp(argv[i], "--sort", 6) && (argv[i][6] == '=' || argv[i][6] == '\0')) {
+            const char *mode = argv[i][6] == '=' ? argv[i] + 7 : (i + 1 < argc ? argv[++i] : "");
+            if (!strcmp(mode, "length")) mopts.sort = MMENU_SORT_LENGTH;
+            else if (!strcmp(mode, "position")) mopts.sort = MMENU_SORT_POSITION;
+            else if (!strcmp(mode, "index")) mopts.sort = MMENU_SORT_INDEX;
+            else { fprintf(stderr, "unknown --sort mode: %s (length|position|index)\n", mode); return 1; }
+        } else if (!strcmp(argv[i], "--ansi")) {
+            mopts.renderer = MMENU_RENDER_ANSI;
+        } else if (!strcmp(argv[i], "--walk")) {
+            if (i + 1 < argc) walk_root = argv[++i];
+        } else if (!strcmp(argv[i], "--ignore")) {
+            if (i + 1 < argc) ignore[walk.n_ignore++] = argv[++i];
+        } else if (!strcmp(argv[i], "--max-depth")) {
+            if (i + 1 < argc) walk.max_depth = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--one-fs")) {
+            walk.one_fs = 1;
+        } else if (!strcmp(argv[i], "--typos")) {
+            if (i + 1 < argc) mopts.typos = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--compress")) {
+            compress = 1;
+        } else if (!strcmp(argv[i], "--paths")) {
+            paths = 1;
+        } else if (!strcmp(argv[i], "--watch")) {
+            if (i + 1 < argc) watch_path = argv[++i];
+        } else if (!strcmp(argv[i], "--queries")) {
+            if (i + 1 < argc) queries_file = argv[++i];
+        } else if (!strcmp(argv[i], "--patterns")) {
+            if (i + 1 < argc) patterns_file = argv[++i];
+        } else if (!strcmp(argv[i], "--which")) {
+            which = 1;
+        } else if (!strcmp(argv[i], "--count")) {
+            count_only = 1;
+        } else if (!strcmp(argv[i], "--threads")) {
+            if (i + 1 < argc) threads = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--max-memory")) {
+            if (i + 1 < argc) {
+                max_memory = parse_size(argv[++i]);
+                if (!max_memory) { fprintf(stderr, "invalid --max-memory size: %s\n", argv[i]); return 1; }
+            }
+        } else if (!strcmp(argv[i], "--daemon")) {
+            if (i + 1 < argc) daemon_sock = argv[++i];
+        } else if (!strcmp(argv[i], "--client")) {
+            if (i + 1 < argc) client_sock = argv[++i];
+        } else if (!strcmp(argv[i], "--corpus")) {
+            if (i + 1 < argc) corpus = argv[++i];
+        } else if (!strcmp(argv[i], "--load") || !strcmp(argv[i], "--list") ||
+                   !strcmp(argv[i], "--drop") || !strcmp(argv[i], "--stop")) {
+            client_op = argv[i] + 2;
         } else if (!strcmp(argv[i], "-t")) {
             output_index = 1;
         } else if (i == 1 && !filter_query) {
             prompt = argv[i];   /* backward compat for positional prompt */
+        } else if (i == 2 && argv[i][0] == 't') {
+            output_index = 1;   /* backward compat: trailing "t"/"true" */
         }
     }
 
-    if (filter_query) {
-        for (int i = 0; i < opts.count; i++) {
-            if (strcasestr(opts.lines[i], filter_query)) {
-                if (output_index) printf("%d\n", i);
-                else printf("%s\n", opts.lines[i]);
-            }
+    if (daemon_sock) return daemon_run(daemon_sock, max_memory);
+    if (client_sock) {
+        const char *t = output_index ? "1" : "0";
+        if (client_op && !strcmp(client_op, "load"))
+            return client_run(client_sock, "load", &corpus, 1, STDIN_FILENO, 0);
+        if (client_op)
+            return client_run(client_sock, client_op, &corpus, 1, -1, 0);
+        if (filter_query) {
+            const char *a[] = { corpus, filter_query, t };
+            return client_run(client_sock, "filter", a, 3, -1, 0);
         }
-        /* cleanup and exit */
-        free(opts.lines);
-        for (int i = 0; i < opts.slabs_count; i++) free(opts.slabs[i]);
-        free(opts.slabs);
+        int ttyfd = open("/dev/tty", O_RDWR | O_CLOEXEC);
+        if (ttyfd < 0) { perror("open /dev/tty"); return 1; }
+        const char *a[4 + CLIENT_ENV_N] = { corpus, prompt, t, mopts.preview_cmd ? mopts.preview_cmd : "" };
+        char *env[CLIENT_ENV_N];
+        int na = 4;
+        for (int i = 0; i < CLIENT_ENV_N; i++) {
+            const char *v = getenv(client_env[i]);
+            if (!v || asprintf(&env[na - 4], "%s=%s", client_env[i], v) < 0) continue;
+            a[na] = env[na - 4];
+            na++;
+        }
+        int rc = client_run(client_sock, "menu", a, na, ttyfd, output_index);
+        for (int i = 4; i < na; i++) free(env[i - 4]);
+        close(ttyfd);
+        return rc;
+    }
+
+    walk.ignore = ignore;
+    /* The --compress and --paths scanners match substrings only; their
+       results carry match positions, not edit counts. */
+    if ((compress || paths) && !watch_path && !walk_root && !mopts.source_cmd && !queries_file && !patterns_file)
+        mopts.typos = 0;
+    if (compress && !watch_path && !walk_root && !mopts.source_cmd && !queries_file && !patterns_file) {
+        zc_t *z = calloc(1, sizeof(zc_t));
+        if (!z) { perror("calloc"); return 1; }
+        z->threads = threads > 0 ? threads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+        if (z->threads < 1) z->threads = 1;
+        setvbuf(stdin, NULL, _IOFBF, 64 * 1024);
+        zc_load(z, stdin);
+        if (filter_query) {
+            zc_filter_ctx c = { z, output_index, stdout };
+            zc_scan(z, filter_query, 0, z->count, zc_filter_hit, &c);
+            zc_free(z);
+            free(z);
+            return 0;
+        }
+        char *chosen_line = NULL;
+        mopts.result_line = &chosen_line;
+        mmenu_vlist vl = { .n_items = z->count, .ud = z, .fetch = zc_fetch, .match = zc_match };
+        long long chosen = mmenu_virtual(&vl, prompt, &mopts);
+        if (chosen == -1) printf("\n");
+        else if (output_index) printf("%lld\n", chosen);
+        else printf("%s\n", chosen_line);
+        free(chosen_line);
+        zc_free(z);
+        free(z);
+        return 0;
+    }
+    if (paths && !watch_path && !walk_root && !mopts.source_cmd && !queries_file && !patterns_file) {
+        fc_t fc = {0};
+        setvbuf(stdin, NULL, _IOFBF, 64 * 1024);
+        fc_load(&fc, stdin);
+        if (filter_query) {
+            fc_filter_ctx c = { &fc, output_index, stdout, 0 };
+            fc_scan(&fc, filter_query, 0, fc.count, fc_filter_hit, &c);
+            fc_free(&fc);
+            return 0;
+        }
+        char *chosen_line = NULL;
+        mopts.result_line = &chosen_line;
+        mmenu_vlist vl = { .n_items = fc.count, .ud = &fc, .fetch = fc_fetch, .match = fc_match };
+        long long chosen = mmenu_virtual(&vl, prompt, &mopts);
+        if (chosen == -1) printf("\n");
+        else if (output_index) printf("%lld\n", chosen);
+        else printf("%s\n", chosen_line);
+        free(chosen_line);
+        fc_free(&fc);
+        return 0;
+    }
+
+    lines_t opts = {0};
+    opts.max_memory = max_memory;
+
+    /* With --source-cmd the producer supplies the rows, with --watch the
+       file and with --walk the directory tree; stdin is not read */
+    watch_t watch;
+    if (walk_root) {
+        if (walk_start(&walk, walk_root, threads, &opts) < 0) return 1;
+        if (queries_file || patterns_file || filter_query) {
+            /* Batch modes need the whole list: let the walk finish first */
+            const char *const *o; const unsigned long long *mk; long long n;
+            walk_finish(&walk, 0);
+            walk_feed(&walk, &o, &mk, &n);
+        } else {
+            mopts.feed = walk_feed;
+            mopts.feed_ud = &walk;
+        }
+    } else if (watch_path) {
+        if (watch_init(&watch, watch_path, &opts) < 0) return 1;
+        mopts.feed = watch_feed;
+        mopts.feed_ud = &watch;
+    } else if (!mopts.source_cmd) {
+        /* Faster buffered input for huge pipes */
+        setvbuf(stdin, NULL, _IOFBF, 64 * 1024);
+        lines_load(&opts, stdin);
+    }
+
+    if (queries_file) {
+        int rc = batch_run(&opts, queries_file, output_index, count_only, threads);
+        lines_free(&opts);
+        return rc;
+    }
+
+    if (patterns_file) {
+        int rc = patterns_run(&opts, patterns_file, output_index, which, count_only, threads);
+        lines_free(&opts);
+        return rc;
+    }
+
+    if (filter_query) {
+        filter_write(&opts, filter_query, output_index, mopts.typos, stdout);
+        lines_free(&opts);
         return 0;
     }
 
     /* Interactive path (prompt already set by the arg loop above) */
-    int chosen = mmenu((const char *const *)opts.lines, opts.count, prompt);
+    char *chosen_line = NULL;
+    mopts.result_line = &chosen_line;
+    mopts.masks = opts.masks;
+    mopts.flags = opts.flags;
+    long long chosen = mmenu_ex64((const char *const *)opts.lines, opts.count, prompt, &mopts);
 
     if (chosen == -1) {
         printf("\n");
     } else {
-        if (argc > 2 && argv[2] && argv[2][0] == 't') {
-            printf("%d\n", chosen);
+        if (output_index) {
+            printf("%lld\n", chosen);
         } else {
-            printf("%s\n", opts.lines[chosen]);
+            printf("%s\n", chosen_line);
         }
     }
 
-    /* Free the O(1) pointer array + the O(total_size / CHUNK) slabs.
-       Massively fewer frees than before (N individual string frees). */
-    free(opts.lines);
-    for (int i = 0; i < opts.slabs_count; i++) free(opts.slabs[i]);
-    free(opts.slabs);
+    free(chosen_line);
+    if (watch_path) watch_close(&watch);
+    if (walk_root) {
+        if (walk.nthreads) walk_finish(&walk, 1);
+        walk_free(&walk);
+    }
+    free(ignore);
+    lines_free(&opts);
     return 0;
 }
@@ -9,15 +9,112 @@
 #define _GNU_SOURCE   /* for strcasestr on glibc */
 
 #include <ncurses.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <locale.h>
+#include <poll.h>
 #include <signal.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
 #include <wchar.h>
 #include <wctype.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* Result orders for mmenu_opts.sort */
+enum { MMENU_SORT_INDEX = 0, MMENU_SORT_LENGTH, MMENU_SORT_POSITION };
+
+/* Renderers for mmenu_opts.renderer */
+enum { MMENU_RENDER_CURSES = 0, MMENU_RENDER_ANSI };
+
+/* Per-line flags from mmenu_utf8_flags(), for mmenu_opts.flags */
+enum { MMENU_LINE_ASCII = 1, MMENU_LINE_VALID = 2 };
+
+/* Optional knobs for mmenu_ex(). Zero-initialise and set what you need;
+   passing NULL behaves exactly like plain mmenu(). */
+typedef struct {
+    const char *preview_cmd;     /* sh command for the preview pane; {} becomes the quoted line */
+    int preview_delay_ms;        /* debounce before spawning a preview (0 = 60 ms) */
+    size_t preview_cache_bytes;  /* LRU budget for finished previews (0 = 4 MiB) */
+    const char *source_cmd;      /* producer re-run per query; {q} becomes the quoted query.
+                                    When set, the options passed in are ignored. */
+    int source_delay_ms;         /* debounce before re-running the producer (0 = 80 ms) */
+    int source_max_lines;        /* stop reading a producer after this many rows (0 = 100000) */
+    size_t source_cache_bytes;   /* LRU budget for recent producer outputs (0 = 16 MiB) */
+    char **result_line;          /* if set, receives a malloc'd copy of the chosen line
+                                    (the only way to get it back in source_cmd mode) */
+    FILE *tty;                   /* terminal to run on (NULL = open /dev/tty); not closed */
+    int sort;                    /* MMENU_SORT_*: input order, shortest line, earliest match */
+    int typos;                   /* allow up to this many edits per match (queries up to
+                                    64 bytes); results are ranked by edit count first */
+    int renderer;                /* MMENU_RENDER_*: ncurses, or raw escapes with one write per frame */
+    const unsigned long long *masks; /* optional mmenu_charmask() of every option, used to
+                                        skip lines that cannot match before any byte search */
+    const unsigned char *flags;  /* optional mmenu_utf8_flags() of every option, so rows
+                                    are not re-examined on every draw; ignored with feed */
+    /* Live input: polled while the menu is idle. It may append options (never
+       reorder or drop them) and then returns nonzero with the possibly moved
+       arrays and the new count stored through its arguments. Only the new
+       options are matched against the current query. */
+    int (*feed)(void *ud, const char *const **options, const unsigned long long **masks,
+                long long *n_options);
+    void *feed_ud;
+} mmenu_opts;
+
+/* Case-folded character-class mask of s[0, len): one bit per letter and
+   digit, punctuation folded onto the remaining bits, bit 63 for any
+   non-ASCII byte. A line can only contain the query if its mask covers the
+   query's mask. */
+unsigned long long mmenu_charmask(const char *s, size_t len);
+
+/* MMENU_LINE_ASCII if s[0, len) is pure ASCII, MMENU_LINE_VALID if it is
+   well-formed UTF-8 (ASCII is both). ASCII rows are drawn byte for byte;
+   bytes that are not valid UTF-8 are drawn as U+FFFD, one per byte. */
+unsigned char mmenu_utf8_flags(const char *s, size_t len);
+
+/* Virtual list for mmenu_virtual(): the caller keeps the rows and mmenu
+   pulls only what it needs to filter and to draw the visible window. A
+   string handed back only has to stay valid until the next callback.
+   Counts and indices are 64-bit, as with mmenu_ex64(). */
+typedef struct {
+    long long n_items;
+    void *ud;
+    /* Item i, NUL-terminated: either copied into buf (cap bytes, truncate
+       as needed) or a pointer the caller owns. Required. */
+    const char *(*fetch)(void *ud, long long i, char *buf, size_t cap);
+    /* Optional: items [from, from + n) into out[]; returns how many were
+       stored. Sequential scans and redraws then ask for runs of up to 64. */
+    int (*fetch_batch)(void *ud, long long from, int n, const char **out);
+    /* Optional: run the query on the caller's side (an index, SQL, ...).
+       Must call hit(ctx, i, off) for every match i in [from, to) in
+       increasing order, off being the byte offset of the match or 0.
+       When set, mmenu does no matching of its own and never fetches rows
+       that are not displayed or sorted. */
+    void (*match)(void *ud, const char *query, long long from, long long to,
+                  void (*hit)(void *ctx, long long i, int off), void *ctx);
+} mmenu_vlist;
 
 int mmenu(const char *const *options, int n_options, const char *prompt);
+int mmenu_ex(const char *const *options, int n_options, const char *prompt,
+             const mmenu_opts *opts);
+/* mmenu_ex() for corpora past 2^31 options: 64-bit count and result
+   (the chosen index or -1). */
+long long mmenu_ex64(const char *const *options, long long n_options, const char *prompt,
+                     const mmenu_opts *opts);
+/* Like mmenu_ex64() over a virtual list; returns the chosen item index or
+   -1. opts->feed is ignored. */
+long long mmenu_virtual(const mmenu_vlist *list, const char *prompt, const mmenu_opts *opts);
 
 #endif /* MMENU_H */
 
@@ -30,15 +127,6 @@ static volatile sig_atomic_t resize_flag = 0;
 
 static void handle_resize(int sig) { (void)sig; resize_flag = 1; }
 
-static wchar_t *mb_to_wc(const char *s) {
-    if (!s) return NULL;
-    size_t n = mbstowcs(NULL, s, 0);
-    if (n == (size_t)-1) return NULL;
-    wchar_t *w = malloc((n + 1) * sizeof(wchar_t));
-    if (w) mbstowcs(w, s, n + 1);
-    return w;
-}
-
 /* Convert the (small) current search input from wchar to multibyte for fast byte matching.
    Only called once per keystroke, not per candidate. */
 static char *wc_to_mb(const wchar_t *w) {
@@ -50,116 +138,1870 @@ static char *wc_to_mb(const wchar_t *w) {
     return m;
 }
 
-typedef struct { int *indices; int cap; int count; } filt;
+/* Result set: matching option indices in input order, plus the byte offset
+   where the query first matched in each, so refinement can resume there.
+   Three representations, picked by density:
+     FILT_ALL   every option [0, count) — the empty query, O(1) to build;
+     FILT_LIST  sorted indices + offsets, for selective queries;
+     FILT_BITS  one bit per option with a rank directory, once more than
+                1/32 of the options match (1 bit instead of 8 bytes each).
+   Bitmaps drop the offsets; refinement then scans those lines from byte 0. */
+enum { FILT_ALL, FILT_LIST, FILT_BITS };
+
+#define FILT_RANK_WORDS 8        /* bitmap words per rank directory entry */
+#define FILT_BITS_MIN   4096     /* lists this short never switch */
+#define FILT_SHARD_BITS 32       /* list entries are offsets inside 2^32-option shards */
+
+/* Counts and option indices are 64-bit, but a list entry stays 4 bytes: it
+   holds the index within its shard, and since entries are sorted each shard
+   is one run, found through shard_first[] (one run for anything under 4G
+   options, so the common case pays nothing). */
+typedef struct {
+    int kind;
+    long long count;
+    long long universe;          /* number of options matched against */
+    unsigned *indices; int *offs; long long cap;
+    long long *shard_first; int shards, shards_cap;   /* list: first entry of shard s */
+    unsigned long long *bits; long long words;
+    long long *rank; long long rank_cap; int rank_ok; /* rank[b] = matches before word b*FILT_RANK_WORDS */
+} filt;
 
-static void filt_init(filt *f) {
-    f->cap = INITIAL_CAP;
-    f->indices = malloc(f->cap * sizeof(int));
-    if (!f->indices) { perror("malloc"); exit(EXIT_FAILURE); }
+static void filt_init_cap(filt *f, long long cap) {
+    memset(f, 0, sizeof(*f));
+    f->kind = FILT_LIST;
+    f->cap = cap < INITIAL_CAP ? INITIAL_CAP : cap;
+    f->indices = malloc((size_t)f->cap * sizeof(*f->indices));
+    f->offs = malloc((size_t)f->cap * sizeof(*f->offs));
+    if (!f->indices || !f->offs) { perror("malloc"); exit(EXIT_FAILURE); }
+}
+
+static void filt_init(filt *f) { filt_init_cap(f, INITIAL_CAP); }
+
+static void filt_clear(filt *f) {
+    f->kind = FILT_LIST;
     f->count = 0;
+    f->shards = 0;
+}
+
+/* Every option matches. */
+static void filt_all(filt *f, long long n) {
+    f->kind = FILT_ALL;
+    f->count = n;
+    f->universe = n;
+}
+
+/* Option index of list entry k, given the shard whose run holds it. */
+static inline long long filt_list_idx(const filt *f, int s, long long k) {
+    return ((long long)s << FILT_SHARD_BITS) + f->indices[k];
+}
+
+/* Shard whose run holds list entry k. */
+static int filt_shard_of(const filt *f, long long k) {
+    int lo = 0, hi = f->shards;
+    while (hi - lo > 1) {
+        int mid = lo + (hi - lo) / 2;
+        if (f->shard_first[mid] <= k) lo = mid; else hi = mid;
+    }
+    return lo;
+}
+
+static void filt_bits_reserve(filt *f, long long idx) {
+    long long need = idx / 64 + 1;
+    if (need <= f->words) return;
+    long long words = f->words ? f->words : 64;
+    while (words < need) words *= 2;
+    unsigned long long *b = realloc(f->bits, (size_t)words * sizeof(*b));
+    if (!b) { perror("realloc"); exit(EXIT_FAILURE); }
+    memset(b + f->words, 0, (size_t)(words - f->words) * sizeof(*b));
+    f->bits = b;
+    f->words = words;
+}
+
+/* Re-encode a list or identity range as a bitmap. */
+static void filt_to_bits(filt *f) {
+    long long n = f->count;
+    long long top = !n ? 0 : f->kind == FILT_ALL ? n - 1 : filt_list_idx(f, f->shards - 1, n - 1);
+    if (f->bits) memset(f->bits, 0, (size_t)f->words * sizeof(*f->bits));
+    filt_bits_reserve(f, top > f->universe ? top : f->universe);
+    if (f->kind == FILT_ALL) {
+        for (long long idx = 0; idx < n; idx++) f->bits[idx / 64] |= 1ULL << (idx % 64);
+    } else {
+        for (int s = 0; s < f->shards; s++) {
+            long long end = s + 1 < f->shards ? f->shard_first[s + 1] : n;
+            for (long long k = f->shard_first[s]; k < end; k++) {
+                long long idx = filt_list_idx(f, s, k);
+                f->bits[idx / 64] |= 1ULL << (idx % 64);
+            }
+        }
+    }
+    f->kind = FILT_BITS;
+    f->rank_ok = 0;
 }
 
-static void filt_push(filt *f, int idx) {
+static void filt_push(filt *f, long long idx, int off) {
+    if (f->kind == FILT_ALL) {
+        if (idx == f->count) { f->count++; return; }
+        filt_to_bits(f);
+    }
+    if (f->kind == FILT_BITS) {
+        filt_bits_reserve(f, idx);
+        f->bits[idx / 64] |= 1ULL << (idx % 64);
+        f->count++;
+        f->rank_ok = 0;
+        return;
+    }
+    if (f->count >= FILT_BITS_MIN && f->count > f->universe / 32) {
+        filt_to_bits(f);
+        filt_push(f, idx, off);
+        return;
+    }
     if (f->count == f->cap) {
         f->cap *= 2;
-        f->indices = realloc(f->indices, f->cap * sizeof(int));
-        if (!f->indices) { perror("realloc"); exit(EXIT_FAILURE); }
+        f->indices = realloc(f->indices, (size_t)f->cap * sizeof(*f->indices));
+        f->offs = realloc(f->offs, (size_t)f->cap * sizeof(*f->offs));
+        if (!f->indices || !f->offs) { perror("realloc"); exit(EXIT_FAILURE); }
+    }
+    int s = (int)(idx >> FILT_SHARD_BITS);
+    while (f->shards <= s) {
+        if (f->shards == f->shards_cap) {
+            f->shards_cap = f->shards_cap ? f->shards_cap * 2 : 4;
+            f->shard_first = realloc(f->shard_first, (size_t)f->shards_cap * sizeof(long long));
+            if (!f->shard_first) { perror("realloc"); exit(EXIT_FAILURE); }
+        }
+        f->shard_first[f->shards++] = f->count;
     }
-    f->indices[f->count++] = idx;
+    f->offs[f->count] = off;
+    f->indices[f->count++] = (unsigned)idx;
 }
 
-static void filt_clear(filt *f) { f->count = 0; }
+static void filt_rank_build(filt *f) {
+    long long blocks = (f->words + FILT_RANK_WORDS - 1) / FILT_RANK_WORDS;
+    if (blocks > f->rank_cap) {
+        f->rank_cap = blocks;
+        free(f->rank);
+        f->rank = malloc((size_t)blocks * sizeof(*f->rank));
+        if (!f->rank) { perror("malloc"); exit(EXIT_FAILURE); }
+    }
+    long long acc = 0;
+    for (long long w = 0; w < f->words; w++) {
+        if (w % FILT_RANK_WORDS == 0) f->rank[w / FILT_RANK_WORDS] = acc;
+        acc += __builtin_popcountll(f->bits[w]);
+    }
+    f->rank_ok = 1;
+}
 
-int mmenu(const char *const *options, int n_options, const char *prompt) {
-    setlocale(LC_ALL, "");
+/* Option index of the k-th match: direct for lists, select() on bitmaps
+   (binary search over the rank directory, then at most FILT_RANK_WORDS
+   popcounts and one in-word select). */
+static long long filt_get(filt *f, long long k) {
+    if (f->kind == FILT_ALL) return k;
+    if (f->kind == FILT_LIST) return f->shards <= 1 ? f->indices[k] : filt_list_idx(f, filt_shard_of(f, k), k);
+    if (!f->rank_ok) filt_rank_build(f);
+    long long lo = 0, hi = (f->words + FILT_RANK_WORDS - 1) / FILT_RANK_WORDS;
+    while (hi - lo > 1) {
+        long long mid = lo + (hi - lo) / 2;
+        if (f->rank[mid] <= k) lo = mid; else hi = mid;
+    }
+    k -= f->rank[lo];
+    for (long long w = lo * FILT_RANK_WORDS; ; w++) {
+        unsigned long long b = f->bits[w];
+        int c = __builtin_popcountll(b);
+        if (k < c) {
+            while (k--) b &= b - 1;
+            return w * 64 + __builtin_ctzll(b);
+        }
+        k -= c;
+    }
+}
+
+/* Run body for every match in order, with k its rank, idx the option index
+   and off the stored match offset (0 when not known). */
+#define FILT_FOREACH(f, k, idx, off, body)                                     \
+    do {                                                                       \
+        const filt *k##_f = (f);                                               \
+        if (k##_f->kind == FILT_LIST) {                                        \
+            for (int k##_s = 0; k##_s < k##_f->shards; k##_s++) {              \
+                long long k##_end = k##_s + 1 < k##_f->shards                  \
+                    ? k##_f->shard_first[k##_s + 1] : k##_f->count;            \
+                for (long long k = k##_f->shard_first[k##_s]; k < k##_end; k++) { \
+                    long long idx = filt_list_idx(k##_f, k##_s, k);            \
+                    int off = k##_f->offs[k];                                  \
+                    (void)off; body;                                           \
+                }                                                              \
+            }                                                                  \
+        } else if (k##_f->kind == FILT_ALL) {                                  \
+            for (long long k = 0; k < k##_f->count; k++) {                     \
+                long long idx = k; int off = 0;                                \
+                (void)off; body;                                               \
+            }                                                                  \
+        } else {                                                               \
+            long long k##_r = 0;                                               \
+            for (long long k##_w = 0; k##_w < k##_f->words; k##_w++) {         \
+                unsigned long long k##_b = k##_f->bits[k##_w];                 \
+                while (k##_b) {                                                \
+                    long long k = k##_r++;                                     \
+                    long long idx = k##_w * 64 + __builtin_ctzll(k##_b);       \
+                    int off = 0;                                               \
+                    k##_b &= k##_b - 1;                                        \
+                    (void)k; (void)off; body;                                  \
+                }                                                              \
+            }                                                                  \
+        }                                                                      \
+    } while (0)
+
+static void filt_free(filt *f) {
+    free(f->indices); free(f->offs); free(f->shard_first); free(f->bits); free(f->rank);
+}
+
+/* ---- Character-presence prefilter ----------------------------------------- */
+
+/* One bit per case-folded letter (0-25) and digit (26-35), printable
+   punctuation folded onto bits 36-62 in byte order, bit 63 for any byte of a
+   non-ASCII sequence; control bytes have none. Constant, so mmenu_charmask()
+   is safe to call from any thread. */
+#define B(n) (1ULL << (n))
+static const unsigned long long mm_mask_table[256] = {
+    ['a'] = B(0), ['A'] = B(0), ['b'] = B(1), ['B'] = B(1), ['c'] = B(2), ['C'] = B(2), ['d'] = B(3), ['D'] = B(3),
+    ['e'] = B(4), ['E'] = B(4), ['f'] = B(5), ['F'] = B(5), ['g'] = B(6), ['G'] = B(6), ['h'] = B(7), ['H'] = B(7),
+    ['i'] = B(8), ['I'] = B(8), ['j'] = B(9), ['J'] = B(9), ['k'] = B(10), ['K'] = B(10), ['l'] = B(11), ['L'] = B(11),
+    ['m'] = B(12), ['M'] = B(12), ['n'] = B(13), ['N'] = B(13), ['o'] = B(14), ['O'] = B(14), ['p'] = B(15), ['P'] = B(15),
+    ['q'] = B(16), ['Q'] = B(16), ['r'] = B(17), ['R'] = B(17), ['s'] = B(18), ['S'] = B(18), ['t'] = B(19), ['T'] = B(19),
+    ['u'] = B(20), ['U'] = B(20), ['v'] = B(21), ['V'] = B(21), ['w'] = B(22), ['W'] = B(22), ['x'] = B(23), ['X'] = B(23),
+    ['y'] = B(24), ['Y'] = B(24), ['z'] = B(25), ['Z'] = B(25),
+    ['0'] = B(26), ['1'] = B(27), ['2'] = B(28), ['3'] = B(29), ['4'] = B(30),
+    ['5'] = B(31), ['6'] = B(32), ['7'] = B(33), ['8'] = B(34), ['9'] = B(35),
+    [' '] = B(36), ['!'] = B(37), ['"'] = B(38), ['#'] = B(39), ['$'] = B(40), ['%'] = B(41),
+    ['&'] = B(42), ['\''] = B(43), ['('] = B(44), [')'] = B(45), ['*'] = B(46), ['+'] = B(47),
+    [','] = B(48), ['-'] = B(49), ['.'] = B(50), ['/'] = B(51), [':'] = B(52), [';'] = B(53),
+    ['<'] = B(54), ['='] = B(55), ['>'] = B(56), ['?'] = B(57), ['@'] = B(58), ['['] = B(59),
+    ['\\'] = B(60), [']'] = B(61), ['^'] = B(62), ['_'] = B(36), ['`'] = B(37), ['{'] = B(38),
+    ['|'] = B(39), ['}'] = B(40), ['~'] = B(41),
+    [0x80 ... 0xff] = B(63),
+};
+#undef B
+
+unsigned long long mmenu_charmask(const char *s, size_t len) {
+    unsigned long long m = 0;
+    const unsigned char *p = (const unsigned char *)s;
+    for (size_t i = 0; i < len; i++) m |= mm_mask_table[p[i]];
+    return m;
+}
+
+/* Bit j is set if line j of the block (n <= 64 lines) has every character
+   class of the query. Branch-free so the compiler vectorises it. */
+static inline unsigned long long mm_mask_block(const unsigned long long *masks, int n,
+                                               unsigned long long qmask) {
+    unsigned long long bits = 0;
+    for (int j = 0; j < n; j++) bits |= (unsigned long long)((masks[j] & qmask) == qmask) << j;
+    return bits;
+}
+
+/* Same for approximate matching: at most k of the query's classes missing. */
+static inline unsigned long long mm_mask_block_k(const unsigned long long *masks, int n,
+                                                 unsigned long long qmask, int k) {
+    if (!k) return mm_mask_block(masks, n, qmask);
+    unsigned long long bits = 0;
+    for (int j = 0; j < n; j++)
+        bits |= (unsigned long long)(__builtin_popcountll(qmask & ~masks[j]) <= k) << j;
+    return bits;
+}
+
+/* Run body for every index i in [0, n) that survives the mask prefilter
+   (all of them when masks is NULL), in increasing order. */
+#define MM_FOREACH_CANDIDATE(i, masks, n, qmask, body)                          \
+    MM_FOREACH_CANDIDATE_K(i, masks, n, qmask, 0, body)
+
+#define MM_FOREACH_CANDIDATE_K(i, masks, n, qmask, k, body)                     \
+    for (long long i##_base = 0; i##_base < (n); i##_base += 64) {             \
+        int i##_w = (n) - i##_base < 64 ? (int)((n) - i##_base) : 64;           \
+        unsigned long long i##_bits = (masks)                                  \
+            ? mm_mask_block_k((masks) + i##_base, i##_w, (qmask), (k))         \
+            : (i##_w == 64 ? ~0ULL : (1ULL << i##_w) - 1);                     \
+        while (i##_bits) {                                                     \
+            long long i = i##_base + __builtin_ctzll(i##_bits);                \
+            i##_bits &= i##_bits - 1;                                          \
+            body;                                                              \
+        }                                                                      \
+    }
+
+/* ---- Approximate matching (typos) ------------------------------------------
+   Myers' bit-parallel edit distance, search variant: the query may start
+   anywhere in the line, and the result is the fewest edits (insertions,
+   deletions, substitutions) over all its occurrences. One 64-bit column per
+   text byte, so queries up to 64 bytes; longer ones fall back to exact
+   matching. ASCII letters are case-folded through the Peq table. Any line
+   that matches a longer query within k edits also matches every prefix of it
+   within k, so refinement stays valid while k does not grow (k is capped
+   below the query length, so it does grow over the first keystrokes, and
+   those rescan); and k edits can remove at most k
+   character classes from the line, so the mask prefilter becomes
+   popcount(qmask & ~mask) <= k. */
+
+#define MM_APPROX_MAX 64
+
+typedef struct {
+    unsigned long long peq[256];
+    unsigned long long hi;   /* bit of the last query character */
+    int m, k;
+} mm_approx_t;
+
+static void mm_approx_init(mm_approx_t *a, const char *q, int k) {
+    memset(a->peq, 0, sizeof(a->peq));
+    size_t m = strlen(q);
+    if (m > MM_APPROX_MAX) m = MM_APPROX_MAX;
+    for (size_t j = 0; j < m; j++) {
+        unsigned char c = (unsigned char)q[j];
+        a->peq[c] |= 1ULL << j;
+        if (c < 128) {
+            a->peq[tolower(c)] |= 1ULL << j;
+            a->peq[toupper(c)] |= 1ULL << j;
+        }
+    }
+    a->m = (int)m;
+    a->hi = m ? 1ULL << (m - 1) : 0;
+    a->k = k;
+}
+
+/* Fewest edits of the query against any substring of s, or -1 if above k. */
+static int mm_approx(const mm_approx_t *a, const char *s) {
+    unsigned long long pv = ~0ULL, mv = 0;
+    int score = a->m, best = a->m;
+    for (const unsigned char *p = (const unsigned char *)s; *p; p++) {
+        unsigned long long eq = a->peq[*p];
+        unsigned long long xv = eq | mv;
+        unsigned long long xh = (((eq & pv) + pv) ^ pv) | eq;
+        unsigned long long ph = mv | ~(xh | pv);
+        unsigned long long mh = pv & xh;
+        if (ph & a->hi) score++;
+        else if (mh & a->hi) score--;
+        ph <<= 1;   /* no carry-in: the match may start at any column */
+        mh <<= 1;
+        pv = mh | ~(xv | ph);
+        mv = ph & xv;
+        if (score < best) {
+            best = score;
+            if (!best) break;
+        }
+    }
+    return best <= a->k ? best : -1;
+}
+
+/* Edits allowed for query q: typos, but fewer than the query's length (a
+   query that may be edited away entirely matches every line), and 0 (exact)
+   when q is too long or empty. */
+static int mm_query_k(const char *q, int typos) {
+    if (typos <= 0 || !q || !*q) return 0;
+    size_t len = strlen(q);
+    if (len > MM_APPROX_MAX) return 0;
+    return (size_t)typos < len ? typos : (int)len - 1;
+}
+
+/* One mask test for both modes: every class present, or at most k missing. */
+static inline int mm_mask_ok(unsigned long long mask, unsigned long long qmask, int k) {
+    return k ? __builtin_popcountll(qmask & ~mask) <= k : (mask & qmask) == qmask;
+}
+
+/* ---- UTF-8 -----------------------------------------------------------------
+   Rows are validated once (at load time when the caller passes
+   mmenu_opts.flags) instead of being run through the locale's multibyte
+   conversion on every draw. The validator skips 16 ASCII bytes per step with
+   SSE2 and only decodes around non-ASCII bytes. Drawing takes a plain byte
+   path for ASCII rows and decodes the rest here, so an invalid byte shows up
+   as U+FFFD rather than blanking its row. */
+
+/* Length of the well-formed UTF-8 sequence at s[0, len) with its code point
+   in *cp, or 0 if s[0] does not start one (overlong forms, surrogates and
+   values past U+10FFFF included). */
+static size_t mm_utf8_decode(const unsigned char *s, size_t len, unsigned *cp) {
+    unsigned c = s[0];
+    if (c < 0x80) { *cp = c; return 1; }
+    size_t n;
+    unsigned min;
+    if (c >= 0xc2 && c <= 0xdf) { n = 2; min = 0x80; c &= 0x1f; }
+    else if ((c & 0xf0) == 0xe0) { n = 3; min = 0x800; c &= 0x0f; }
+    else if (c >= 0xf0 && c <= 0xf4) { n = 4; min = 0x10000; c &= 0x07; }
+    else return 0;
+    if (len < n) return 0;
+    for (size_t i = 1; i < n; i++) {
+        if ((s[i] & 0xc0) != 0x80) return 0;
+        c = c << 6 | (s[i] & 0x3f);
+    }
+    if (c < min || c > 0x10ffff || (c >= 0xd800 && c <= 0xdfff)) return 0;
+    *cp = c;
+    return n;
+}
+
+unsigned char mmenu_utf8_flags(const char *s, size_t len) {
+    const unsigned char *p = (const unsigned char *)s;
+    unsigned char flags = MMENU_LINE_ASCII | MMENU_LINE_VALID;
+    size_t i = 0;
+    while (i < len) {
+#ifdef __SSE2__
+        while (i + 16 <= len && !_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(p + i)))) i += 16;
+        if (i == len) break;
+#endif
+        if (p[i] < 0x80) { i++; continue; }
+        unsigned cp;
+        size_t k = mm_utf8_decode(p + i, len - i, &cp);
+        if (!k) return 0;
+        flags = MMENU_LINE_VALID;
+        i += k;
+    }
+    return flags;
+}
+
+/* ---- Item access -----------------------------------------------------------
+   Rows come from a plain array or from a caller's mmenu_vlist. mm_item()
+   hides the difference; virtual rows live in a scratch buffer (or a batch
+   window) that the next call may overwrite, so use the result right away. */
+
+#define MM_ITEM_CAP 4096
+#define MM_BATCH 64
+
+typedef struct {
+    const char *const *arr;
+    const mmenu_vlist *vl;
+    const unsigned char *flags;   /* mmenu_opts.flags, when they describe arr */
+    const char *batch[MM_BATCH];
+    long long batch_from;
+    int batch_n;
+    char buf[MM_ITEM_CAP];
+} mm_items;
+
+static const char *mm_item(mm_items *it, long long idx) {
+    if (!it->vl) return it->arr[idx];
+    long long i = idx;
+    const mmenu_vlist *vl = it->vl;
+    if (vl->fetch_batch) {
+        if (i < it->batch_from || i >= it->batch_from + it->batch_n) {
+            int n = vl->n_items - i < MM_BATCH ? (int)(vl->n_items - i) : MM_BATCH;
+            it->batch_from = i;
+            it->batch_n = vl->fetch_batch(vl->ud, i, n, it->batch);
+        }
+        if (i < it->batch_from + it->batch_n) return it->batch[i - it->batch_from];
+    }
+    const char *s = vl->fetch(vl->ud, i, it->buf, sizeof(it->buf));
+    it->batch_n = 0;   /* any callback may invalidate the batch window */
+    return s ? s : "";
+}
+
+/* mmenu_utf8_flags() of item idx, whose text s[0, len) is at hand. */
+static unsigned char mm_item_flags(const mm_items *it, long long idx, const char *s, size_t len) {
+    return it->flags ? it->flags[idx] : mmenu_utf8_flags(s, len);
+}
+
+static void mm_hit(void *ctx, long long i, int off);
+
+static long long mm_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* ---- Child processes -------------------------------------------------------
+   Preview and --source-cmd producers run through sh -c in their own process
+   group with stdout/stderr on a non-blocking pipe. The main loop never waits
+   on them: wget_wch gets a short timeout while one is pending or running and
+   every idle tick drains whatever bytes are available. Superseded children
+   are killed as a group so pipelines die too. */
+
+#define CHILD_POLL_MS 10
+
+/* Expand every occurrence of token in cmd with value, single-quoted for sh. */
+static char *mm_expand(const char *cmd, const char *token, const char *value) {
+    size_t tlen = strlen(token);
+    size_t qlen = 2;
+    for (const char *c = value; *c; c++) qlen += *c == '\'' ? 4 : 1;
+    size_t n = 0;
+    for (const char *c = cmd; *c; ) {
+        if (!strncmp(c, token, tlen)) { n += qlen; c += tlen; }
+        else { n++; c++; }
+    }
+    char *out = malloc(n + 1);
+    if (!out) { perror("malloc"); exit(EXIT_FAILURE); }
+    char *o = out;
+    for (const char *c = cmd; *c; ) {
+        if (!strncmp(c, token, tlen)) {
+            *o++ = '\'';
+            for (const char *v = value; *v; v++) {
+                if (*v == '\'') { memcpy(o, "'\\''", 4); o += 4; }
+                else *o++ = *v;
+            }
+            *o++ = '\'';
+            c += tlen;
+        } else {
+            *o++ = *c++;
+        }
+    }
+    *o = '\0';
+    return out;
+}
+
+static pid_t mm_spawn_sh(const char *cmd, int *fd_out) {
+    int pfd[2];
+    if (pipe(pfd) < 0) return -1;
+    pid_t pid = fork();
+    if (pid < 0) { close(pfd[0]); close(pfd[1]); return -1; }
+    if (pid == 0) {
+        setpgid(0, 0);   /* so the whole pipeline dies with one kill(-pid) */
+        int devnull = open("/dev/null", O_RDONLY);
+        if (devnull >= 0) dup2(devnull, STDIN_FILENO);
+        dup2(pfd[1], STDOUT_FILENO);
+        dup2(pfd[1], STDERR_FILENO);
+        close(pfd[0]); close(pfd[1]);
+        execl("/bin/sh", "sh", "-c", cmd, (char *)NULL);
+        _exit(127);
+    }
+    setpgid(pid, pid);
+    close(pfd[1]);
+    fcntl(pfd[0], F_SETFL, fcntl(pfd[0], F_GETFL) | O_NONBLOCK);
+    fcntl(pfd[0], F_SETFD, FD_CLOEXEC);
+    *fd_out = pfd[0];
+    return pid;
+}
+
+static void mm_child_kill(pid_t *pid, int *fd) {
+    if (*pid > 0) {
+        kill(-*pid, SIGKILL);
+        while (waitpid(*pid, NULL, 0) < 0 && errno == EINTR);
+        *pid = 0;
+    }
+    if (*fd >= 0) { close(*fd); *fd = -1; }
+}
+
+/* Byte-bounded LRU keyed by the expanded command. Entry counts stay small
+   (a few hundred at most), so a linear scan beats anything clever. */
+typedef struct { char *key; char *data; size_t len; int lines; unsigned long used; } mm_cache_entry;
+
+typedef struct {
+    mm_cache_entry *e;
+    int count, cap;
+    size_t bytes, budget;
+    unsigned long tick;
+} mm_cache;
+
+static const mm_cache_entry *mm_cache_get(mm_cache *c, const char *key) {
+    for (int i = 0; i < c->count; i++) {
+        if (!strcmp(c->e[i].key, key)) {
+            c->e[i].used = ++c->tick;
+            return &c->e[i];
+        }
+    }
+    return NULL;
+}
+
+static void mm_cache_put(mm_cache *c, const char *key, const char *data, size_t len, int lines) {
+    if (len > c->budget) return;
+    while (c->count && c->bytes + len > c->budget) {
+        int lru = 0;
+        for (int i = 1; i < c->count; i++)
+            if (c->e[i].used < c->e[lru].used) lru = i;
+        c->bytes -= c->e[lru].len;
+        free(c->e[lru].key);
+        free(c->e[lru].data);
+        c->e[lru] = c->e[--c->count];
+    }
+    if (c->count == c->cap) {
+        c->cap = c->cap ? c->cap * 2 : 16;
+        c->e = realloc(c->e, c->cap * sizeof(mm_cache_entry));
+        if (!c->e) { perror("realloc"); exit(EXIT_FAILURE); }
+    }
+    mm_cache_entry *e = &c->e[c->count++];
+    e->key = strdup(key);
+    e->data = malloc(len + 1);
+    if (!e->key || !e->data) { perror("malloc"); exit(EXIT_FAILURE); }
+    memcpy(e->data, data, len);
+    e->data[len] = '\0';
+    e->len = len;
+    e->lines = lines;
+    e->used = ++c->tick;
+    c->bytes += len;
+}
+
+static void mm_cache_free(mm_cache *c) {
+    for (int i = 0; i < c->count; i++) { free(c->e[i].key); free(c->e[i].data); }
+    free(c->e);
+}
+
+/* Grow a byte buffer so at least want more bytes (plus a nul) fit. */
+static void mm_buf_reserve(char **buf, size_t *cap, size_t len, size_t want) {
+    if (*cap - len >= want + 1) return;
+    size_t ncap = *cap ? *cap : 8192;
+    while (ncap - len < want + 1) ncap *= 2;
+    *buf = realloc(*buf, ncap);
+    if (!*buf) { perror("realloc"); exit(EXIT_FAILURE); }
+    *cap = ncap;
+}
+
+/* ---- Preview pane ----------------------------------------------------------
+   Only as many lines as fit in the pane are read; once those arrived the
+   child is killed. Finished previews go into the LRU, so revisiting an item
+   is a lookup instead of a fork. */
+
+#define PREVIEW_DEFAULT_DELAY 60
+#define PREVIEW_DEFAULT_CACHE (4 * 1024 * 1024)
+#define PREVIEW_MAX_BYTES (256 * 1024)   /* hard cap per preview, whatever the pane height */
+
+typedef struct {
+    const char *cmd;
+    int delay_ms;
+    mm_cache cache;
+
+    char *key;            /* expanded command of the preview we want on screen */
+    char *buf;            /* its output so far (or the cached copy) */
+    size_t len, cap;
+    int lines;            /* newlines in buf */
+    int pending;          /* waiting for the debounce to expire */
+    long long due_ms;
+    pid_t pid;            /* running child, or 0 */
+    int fd;
+} preview_t;
+
+static void preview_init(preview_t *p, const mmenu_opts *opts) {
+    memset(p, 0, sizeof(*p));
+    p->fd = -1;
+    if (!opts) return;
+    p->cmd = opts->preview_cmd;
+    p->delay_ms = opts->preview_delay_ms > 0 ? opts->preview_delay_ms : PREVIEW_DEFAULT_DELAY;
+    p->cache.budget = opts->preview_cache_bytes ? opts->preview_cache_bytes : PREVIEW_DEFAULT_CACHE;
+}
+
+/* Ask for the preview of line. Cache hits are shown immediately; misses kill
+   whatever is still running and arm the debounce timer. */
+static void preview_request(preview_t *p, const char *line, long long now) {
+    if (!p->cmd) return;
+    char *key = mm_expand(p->cmd, "{}", line ? line : "");
+    if (p->key && !strcmp(p->key, key)) { free(key); return; }
+    mm_child_kill(&p->pid, &p->fd);
+    free(p->key);
+    p->key = key;
+    p->pending = 0;
+    const mm_cache_entry *e = mm_cache_get(&p->cache, key);
+    if (e) {
+        p->len = 0;
+        mm_buf_reserve(&p->buf, &p->cap, 0, e->len);
+        memcpy(p->buf, e->data, e->len + 1);
+        p->len = e->len;
+        p->lines = e->lines;
+        return;
+    }
+    p->pending = 1;
+    p->due_ms = now + p->delay_ms;
+}
+
+/* Idle-time work: start a due preview, drain its pipe. Returns 1 if the
+   pane content changed and needs a redraw. */
+static int preview_tick(preview_t *p, long long now, int want_lines) {
+    if (!p->cmd) return 0;
+    int changed = 0;
+    if (p->pending && now >= p->due_ms) {
+        p->pending = 0;
+        p->len = 0; p->lines = 0;
+        mm_buf_reserve(&p->buf, &p->cap, 0, 0);
+        p->buf[0] = '\0';
+        p->pid = mm_spawn_sh(p->key, &p->fd);
+        if (p->pid < 0) {
+            p->pid = 0;
+            mm_buf_reserve(&p->buf, &p->cap, 0, 64);
+            p->len = (size_t)sprintf(p->buf, "preview: fork failed\n");
+            p->lines = 1;
+        }
+        changed = 1;
+    }
+    if (p->fd < 0) return changed;
+
+    int eof = 0;
+    for (;;) {
+        mm_buf_reserve(&p->buf, &p->cap, p->len, 4096);
+        ssize_t r = read(p->fd, p->buf + p->len, p->cap - p->len - 1);
+        if (r > 0) {
+            for (ssize_t i = 0; i < r; i++) p->lines += p->buf[p->len + i] == '\n';
+            p->len += (size_t)r;
+            p->buf[p->len] = '\0';
+            changed = 1;
+            if (p->lines >= want_lines || p->len >= PREVIEW_MAX_BYTES) { eof = 1; break; }
+        } else if (r == 0) {
+            eof = 1; break;
+        } else {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) eof = 1;
+            break;
+        }
+    }
+    if (eof) {
+        mm_child_kill(&p->pid, &p->fd);
+        mm_cache_put(&p->cache, p->key, p->buf, p->len, p->lines);
+    }
+    return changed;
+}
+
+/* How long wget_wch may block before the preview needs attention again. */
+static int preview_timeout(const preview_t *p, long long now) {
+    if (p->pid > 0) return CHILD_POLL_MS;
+    if (p->pending) return p->due_ms > now ? (int)(p->due_ms - now) : 0;
+    return -1;
+}
+
+static void preview_free(preview_t *p) {
+    mm_child_kill(&p->pid, &p->fd);
+    mm_cache_free(&p->cache);
+    free(p->key);
+    free(p->buf);
+}
+
+/* ---- Dynamic source (--source-cmd) -----------------------------------------
+   Instead of filtering a resident list, the producer command is re-run with
+   {q} replaced by the query and its output becomes the list. Output is
+   parsed in place ('\n' -> '\0') as it streams in, so rows show up while the
+   producer is still running. A query change kills the producer and drops its
+   partial output; finished outputs are kept in an LRU so backspacing over a
+   query is free. Memory is bounded by max_lines, not by the dataset. */
+
+#define SOURCE_DEFAULT_DELAY 80
+#define SOURCE_DEFAULT_CACHE (16 * 1024 * 1024)
+#define SOURCE_DEFAULT_MAX_LINES 100000
+
+typedef struct {
+    const char *cmd;
+    int delay_ms;
+    int max_lines;
+    mm_cache cache;
+
+    char *key;            /* expanded command for the current query */
+    int pending;
+    long long due_ms;
+    pid_t pid;
+    int fd;
+
+    char *buf;            /* producer output, lines nul-terminated in place */
+    size_t len, cap;
+    size_t line_start;    /* start of the trailing incomplete line */
+    const char **lines;   /* pointers into buf, rebuilt when buf moves */
+    size_t *offs;
+    int count, lines_cap;
+} source_t;
+
+static void source_init(source_t *s, const mmenu_opts *opts) {
+    memset(s, 0, sizeof(*s));
+    s->fd = -1;
+    if (!opts) return;
+    s->cmd = opts->source_cmd;
+    s->delay_ms = opts->source_delay_ms > 0 ? opts->source_delay_ms : SOURCE_DEFAULT_DELAY;
+    s->max_lines = opts->source_max_lines > 0 ? opts->source_max_lines : SOURCE_DEFAULT_MAX_LINES;
+    s->cache.budget = opts->source_cache_bytes ? opts->source_cache_bytes : SOURCE_DEFAULT_CACHE;
+}
+
+static void source_push_line(source_t *s, size_t off) {
+    if (s->count == s->lines_cap) {
+        s->lines_cap = s->lines_cap ? s->lines_cap * 2 : INITIAL_CAP;
+        s->lines = realloc(s->lines, s->lines_cap * sizeof(char *));
+        s->offs = realloc(s->offs, s->lines_cap * sizeof(size_t));
+        if (!s->lines || !s->offs) { perror("realloc"); exit(EXIT_FAILURE); }
+    }
+    s->offs[s->count] = off;
+    s->lines[s->count++] = s->buf + off;
+}
+
+static void source_repoint(source_t *s) {
+    for (int i = 0; i < s->count; i++) s->lines[i] = s->buf + s->offs[i];
+}
+
+/* The query changed: cancel the in-flight producer and its partial rows,
+   then serve from the cache or arm the debounce timer. */
+static void source_request(source_t *s, const char *query, long long now) {
+    char *key = mm_expand(s->cmd, "{q}", query ? query : "");
+    if (s->key && !strcmp(s->key, key)) { free(key); return; }
+    mm_child_kill(&s->pid, &s->fd);
+    free(s->key);
+    s->key = key;
+    s->count = 0;
+    s->len = s->line_start = 0;
+    s->pending = 0;
+    const mm_cache_entry *e = mm_cache_get(&s->cache, key);
+    if (e) {
+        mm_buf_reserve(&s->buf, &s->cap, 0, e->len);
+        memcpy(s->buf, e->data, e->len + 1);
+        s->len = s->line_start = e->len;
+        for (size_t off = 0; off < e->len; off += strlen(s->buf + off) + 1)
+            source_push_line(s, off);
+        return;
+    }
+    s->pending = 1;
+    s->due_ms = now + s->delay_ms;
+}
+
+/* Idle-time work: start a due producer and parse whatever it wrote.
+   Returns 1 if rows were added or the list was reset. */
+static int source_tick(source_t *s, long long now) {
+    if (!s->cmd) return 0;
+    int changed = 0;
+    if (s->pending && now >= s->due_ms) {
+        s->pending = 0;
+        s->pid = mm_spawn_sh(s->key, &s->fd);
+        if (s->pid < 0) s->pid = 0;
+        changed = 1;
+    }
+    if (s->fd < 0) return changed;
 
-    FILE *tty = fopen("/dev/tty", "r+");
-    if (!tty) { perror("fopen /dev/tty"); exit(EXIT_FAILURE); }
+    int eof = 0;
+    char *old = s->buf;
+    for (;;) {
+        mm_buf_reserve(&s->buf, &s->cap, s->len, 64 * 1024);
+        ssize_t r = read(s->fd, s->buf + s->len, s->cap - s->len - 1);
+        if (r > 0) {
+            if (s->buf != old) { source_repoint(s); old = s->buf; }
+            char *p = s->buf + s->len, *end = p + r;
+            s->len += (size_t)r;
+            s->buf[s->len] = '\0';
+            while ((p = memchr(p, '\n', (size_t)(end - p)))) {
+                *p++ = '\0';
+                source_push_line(s, s->line_start);
+                s->line_start = (size_t)(p - s->buf);
+                if (s->count >= s->max_lines) { eof = 1; break; }
+            }
+            changed = 1;
+            if (eof) { s->len = s->line_start; break; }
+        } else if (r == 0) {
+            eof = 1; break;
+        } else {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) eof = 1;
+            break;
+        }
+    }
+    if (s->buf != old) source_repoint(s);
+    if (eof) {
+        if (s->line_start < s->len) {   /* last line without trailing newline */
+            source_push_line(s, s->line_start);
+            s->len++;
+            s->line_start = s->len;
+            changed = 1;
+        }
+        mm_child_kill(&s->pid, &s->fd);
+        mm_cache_put(&s->cache, s->key, s->buf, s->len, s->count);
+    }
+    return changed;
+}
+
+#define FEED_POLL_MS 100
 
-    SCREEN *scr = newterm(NULL, tty, tty);
-    if (!scr) { fclose(tty); fprintf(stderr, "Failed to init ncurses\n"); return -1; }
-    set_term(scr);
+/* Match options [from, n) against q and append the hits to f. With typos
+   the stored offset is the edit count instead of the match position. */
+static void mm_match_tail(mm_items *it, const unsigned long long *masks,
+                          long long from, long long n, const char *q, int typos, filt *f) {
+    f->universe = n;
+    if (!q || !*q) {
+        if (from == 0 && f->count == 0) filt_all(f, n);
+        else for (long long i = from; i < n; i++) filt_push(f, i, 0);
+        return;
+    }
+    if (it->vl && it->vl->match) {
+        it->vl->match(it->vl->ud, q, from, n, mm_hit, f);
+        it->batch_n = 0;
+        return;
+    }
+    unsigned long long qmask = mmenu_charmask(q, strlen(q));
+    int k = mm_query_k(q, typos);
+    if (k) {
+        mm_approx_t ap;
+        mm_approx_init(&ap, q, k);
+        MM_FOREACH_CANDIDATE_K(j, masks ? masks + from : NULL, n - from, qmask, k, {
+            int e = mm_approx(&ap, mm_item(it, from + j));
+            if (e >= 0) filt_push(f, from + j, e);
+        });
+        return;
+    }
+    MM_FOREACH_CANDIDATE(j, masks ? masks + from : NULL, n - from, qmask, {
+        long long i = from + j;
+        const char *s = mm_item(it, i);
+        const char *m = strcasestr(s, q);
+        if (m) filt_push(f, i, (int)(m - s));
+    });
+}
 
+static int source_timeout(const source_t *s, long long now) {
+    if (s->pid > 0) return CHILD_POLL_MS;
+    if (s->pending) return s->due_ms > now ? (int)(s->due_ms - now) : 0;
+    return -1;
+}
+
+/* In source mode the result list is simply every row the producer emitted. */
+static void source_sync(const source_t *s, filt *f) { filt_all(f, s->count); }
+
+static void source_free(source_t *s) {
+    mm_child_kill(&s->pid, &s->fd);
+    mm_cache_free(&s->cache);
+    free(s->key);
+    free(s->buf);
+    free(s->lines);
+    free(s->offs);
+}
+
+/* Smaller of two wget_wch timeouts, where -1 means "block". */
+static int mm_min_timeout(int a, int b) {
+    if (a < 0) return b;
+    if (b < 0) return a;
+    return a < b ? a : b;
+}
+
+/* ---- Speculative refinement ------------------------------------------------
+   While the loop is idle, refine the current matches for the likeliest next
+   keystrokes so that typing one of them costs nothing. The guesses are the
+   SPEC_MAX most frequent bytes (case-folded) right after the query's first
+   match, sampled over the current results. Work runs in slices of
+   SPEC_SLICE candidates with a zero input timeout in between, so a key press
+   is seen after one slice at most. Any change to the result set throws the
+   guesses away; a correct guess is adopted (finished inline if it was only
+   partly done) in place of the normal refinement. */
+
+#define SPEC_MAX 3
+#define SPEC_MIN 4096      /* smaller result sets refine fast enough as it is */
+#define SPEC_SLICE 4096    /* candidates per idle step */
+#define SPEC_SAMPLE 4096   /* matches inspected for the next-byte histogram */
+
+typedef struct {
+    int n;                      /* guesses in play */
+    int cur;                    /* guess being computed */
+    unsigned char c[SPEC_MAX];
+    char *q[SPEC_MAX];          /* current query + guessed byte */
+    unsigned long long qmask[SPEC_MAX];
+    filt res[SPEC_MAX];
+    long long pos[SPEC_MAX];    /* ranks of the current results consumed */
+} spec_t;
+
+static void spec_stop(spec_t *sp) {
+    for (int g = 0; g < sp->n; g++) {
+        free(sp->q[g]);
+        filt_free(&sp->res[g]);
+    }
+    sp->n = sp->cur = 0;
+}
+
+/* Stored match offset of result r (0 where the representation has none). */
+static int filt_off(const filt *f, long long r) { return f->kind == FILT_LIST ? f->offs[r] : 0; }
+
+static void spec_start(spec_t *sp, mm_items *it, filt *f, const char *q) {
+    spec_stop(sp);
+    if (!q || !*q || f->count < SPEC_MIN || (it->vl && it->vl->match)) return;
+    size_t qlen = strlen(q);
+    int hist[128] = {0};
+    int samples = f->count < SPEC_SAMPLE ? (int)f->count : SPEC_SAMPLE;
+    for (int k = 0; k < samples; k++) {
+        long long r = (long long)((double)k * f->count / samples);
+        const char *s = mm_item(it, filt_get(f, r));
+        const char *m = f->kind == FILT_LIST ? s + f->offs[r] : strcasestr(s, q);
+        if (!m) continue;
+        unsigned char c = (unsigned char)m[qlen];
+        if (c >= 0x20 && c < 0x7f) hist[tolower(c)]++;
+    }
+    for (int g = 0; g < SPEC_MAX; g++) {
+        int best = 0;
+        for (int c = 1; c < 128; c++) if (hist[c] > hist[best]) best = c;
+        if (!hist[best]) break;
+        hist[best] = 0;
+        sp->c[g] = (unsigned char)best;
+        sp->q[g] = malloc(qlen + 2);
+        if (!sp->q[g]) { perror("malloc"); exit(EXIT_FAILURE); }
+        memcpy(sp->q[g], q, qlen);
+        sp->q[g][qlen] = (char)best;
+        sp->q[g][qlen + 1] = '\0';
+        sp->qmask[g] = mmenu_charmask(sp->q[g], qlen + 1);
+        filt_init(&sp->res[g]);
+        sp->res[g].universe = f->universe;
+        sp->pos[g] = 0;
+        sp->n++;
+    }
+}
+
+/* Refine guess g over ranks [pos, end) of f. */
+static void spec_run(spec_t *sp, int g, mm_items *it, const unsigned long long *masks,
+                     filt *f, long long end) {
+    const char *q = sp->q[g];
+    for (long long r = sp->pos[g]; r < end; r++) {
+        long long oidx = filt_get(f, r);
+        if (masks && (masks[oidx] & sp->qmask[g]) != sp->qmask[g]) continue;
+        const char *s = mm_item(it, oidx);
+        const char *m = strcasestr(s + filt_off(f, r), q);
+        if (m) filt_push(&sp->res[g], oidx, (int)(m - s));
+    }
+    sp->pos[g] = end;
+}
+
+static int spec_busy(const spec_t *sp) { return sp->cur < sp->n; }
+
+/* Lines appended to the corpus only add ranks after the ones already
+   consumed, so the guesses stay valid: resume at the first unfinished one. */
+static void spec_grow(spec_t *sp, const filt *f) {
+    sp->cur = sp->n;
+    for (int g = sp->n - 1; g >= 0; g--) {
+        sp->res[g].universe = f->universe;
+        if (sp->pos[g] < f->count) sp->cur = g;
+    }
+}
+
+/* One idle slice. */
+static void spec_step(spec_t *sp, mm_items *it, const unsigned long long *masks, filt *f) {
+    if (!spec_busy(sp)) return;
+    int g = sp->cur;
+    long long end = sp->pos[g] + SPEC_SLICE;
+    if (end >= f->count) { end = f->count; sp->cur++; }
+    spec_run(sp, g, it, masks, f, end);
+}
+
+/* If byte c was guessed, finish that guess and move it into *out. */
+static int spec_take(spec_t *sp, wint_t ch, mm_items *it, const unsigned long long *masks,
+                     filt *f, filt *out) {
+    if (ch >= 128) return 0;
+    int c = tolower((int)ch);
+    for (int g = 0; g < sp->n; g++) {
+        if (sp->c[g] != c) continue;
+        spec_run(sp, g, it, masks, f, f->count);
+        *out = sp->res[g];
+        filt_init(&sp->res[g]);   /* keep spec_stop's free valid */
+        return 1;
+    }
+    return 0;
+}
+
+/* ---- Refine or rescan ------------------------------------------------------
+   Typing one more character can either walk the previous matches (fewer
+   lines, but they are spread over the corpus) or scan all options front to
+   back (more lines, but a sequential sweep the mask prefilter mostly
+   rejects 64 at a time). Which is faster depends on the corpus and machine,
+   so both are modelled as nanoseconds per line visited: seeded at startup
+   by timing each access pattern on a small sample with a probe query, then
+   kept as an exponential moving average of the measured keystrokes. Each
+   keystroke takes whichever predicts less. Only the strategy that ran gets
+   measured, so one slow sample (a cold cache) could shut the other out for
+   good; after the same choice COST_RECHECK times in a row (COST_RECHECK_CLOSE
+   when the predictions are within 2x) the other one runs once and its
+   estimate is replaced by what it costs now. */
+
+#define COST_PROBE 8192   /* sample lines per strategy at startup */
+#define COST_EMA 0.25     /* weight of the newest measurement */
+#define COST_MIN_LINES 4096 /* smaller passes are dominated by fixed costs */
+#define COST_RECHECK 16
+#define COST_RECHECK_CLOSE 4
+
+typedef struct {
+    double refine_ns;     /* per previous match walked */
+    double scan_ns;       /* per option scanned */
+    int last;             /* strategy of the last choice: 1 = refine */
+    int streak;           /* choices in a row that went to last */
+    int recheck;          /* this keystroke re-measures the losing strategy */
+} mm_cost;
+
+static long long mm_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void cost_update(mm_cost *c, double *ns, long long elapsed, long long lines) {
+    if (lines < COST_MIN_LINES) return;
+    *ns += (c->recheck ? 1 : COST_EMA) * ((double)elapsed / (double)lines - *ns);
+}
+
+/* Time a contiguous run and a strided (scattered) sample of options with a
+   probe taken from the middle option. Too small a corpus, or one behind
+   callbacks, keeps the neutral defaults. */
+static void cost_calibrate(mm_cost *c, mm_items *it, const unsigned long long *masks, long long n) {
+    c->refine_ns = c->scan_ns = 1;
+    c->last = c->streak = c->recheck = 0;
+    if (it->vl || n < 4 * COST_PROBE) return;
+    const char *mid = mm_item(it, n / 2);
+    size_t len = strlen(mid);
+    char probe[3] = { 'e', 0, 0 };
+    if (len >= 2) memcpy(probe, mid + len / 2 - 1, 2);
+    unsigned long long qmask = mmenu_charmask(probe, strlen(probe));
+    long long hits = 0;
+    long long t0 = mm_now_ns();
+    MM_FOREACH_CANDIDATE(i, masks, COST_PROBE, qmask, {
+        if (strcasestr(mm_item(it, i), probe)) hits++;
+    });
+    long long t1 = mm_now_ns();
+    long long stride = n / COST_PROBE;
+    for (long long i = stride / 2; i < n; i += stride) {
+        if (masks && (masks[i] & qmask) != qmask) continue;
+        if (strcasestr(mm_item(it, i), probe)) hits++;
+    }
+    long long t2 = mm_now_ns();
+    c->scan_ns = (double)(t1 - t0) / COST_PROBE;
+    c->refine_ns = (double)(t2 - t1) / COST_PROBE;
+    (void)hits;
+}
+
+static int cost_prefer_refine(mm_cost *c, long long prev, long long n) {
+    double r = (double)prev * c->refine_ns, s = (double)n * c->scan_ns;
+    int pick = r <= s;
+    double lo = pick ? r : s, hi = pick ? s : r;
+    c->recheck = 0;
+    if (pick != c->last) c->streak = 0;
+    else if (++c->streak >= (hi < 2 * lo ? COST_RECHECK_CLOSE : COST_RECHECK)) {
+        c->recheck = 1;
+        pick = !pick;
+        c->streak = 0;
+    }
+    c->last = pick;
+    return pick;
+}
+
+/* ---- Result ordering (--sort) ----------------------------------------------
+   Matches are always collected in input order. For the other orders every
+   match gets a 64-bit key (primary key << shift | option index, so ties fall
+   back to input order and the order is total; shift is 32 unless the corpus
+   needs wider indices, which leaves the primary key fewer bits before it
+   saturates), but only the rows that are
+   actually looked at get sorted. The keys are kept as a row of segments,
+   each holding only keys below the next segment's, some of them sorted
+   inside. view_ensure() quickselects the unsorted segments around the
+   requested window down to the window plus a chunk either side and sorts
+   just that, so a keystroke costs O(M + k log k) for the k rows on screen
+   instead of O(M log M), and jumping into the middle of the list costs one
+   partition of the segment it lands in. */
+
+#define SORT_CHUNK 256
+#define SORT_SEGS 64
+
+typedef struct {
+    int mode;                 /* MMENU_SORT_* */
+    int typos;                /* rank by edit count first (mmenu_opts.typos) */
+    int keyed;                /* keys are in use (any order but plain input order) */
+    unsigned long long *keys;
+    int shift;                /* option index bits in a key */
+    long long cap;
+    long long count;
+    long long cut[SORT_SEGS + 1];     /* segment s is keys[cut[s], cut[s + 1]) */
+    unsigned char done[SORT_SEGS];    /* segment s is sorted */
+    int segs;
+} sort_view;
+
+static void view_init(sort_view *v, const mmenu_opts *opts) {
+    memset(v, 0, sizeof(*v));
+    v->mode = opts ? opts->sort : MMENU_SORT_INDEX;
+    v->typos = opts ? opts->typos : 0;
+}
+
+/* Rebuild the keys after the result set changed. Bitmaps carry no match
+   offsets (or edit counts), so those are recomputed from the query q; so are
+   edit counts for match hooks, whose offsets are always byte positions. With
+   typos the edit count goes in the top bits of the primary key; match
+   positions are unknown then and position order degrades to input order. */
+static void view_reset(sort_view *v, mm_items *it, const filt *f, const char *q) {
+    int k = mm_query_k(q, v->typos);
+    v->keyed = v->mode != MMENU_SORT_INDEX || k;
+    if (!v->keyed) return;
+    if (f->count > v->cap) {
+        v->cap = f->count;
+        free(v->keys);
+        v->keys = malloc((size_t)v->cap * sizeof(unsigned long long));
+        if (!v->keys) { perror("malloc"); exit(EXIT_FAILURE); }
+    }
+    int hooked = it->vl && it->vl->match;
+    int need_off = (k || v->mode == MMENU_SORT_POSITION) && (f->kind == FILT_BITS || (k && hooked)) && q && *q;
+    v->shift = 32;
+    while (v->shift < 62 && f->universe > 1LL << v->shift) v->shift++;
+    size_t pmax = (1ULL << (64 - v->shift)) - 1;
+    mm_approx_t ap;
+    if (k && need_off) mm_approx_init(&ap, q, k);
+    FILT_FOREACH(f, r, oidx, off, {
+        size_t primary;
+        if (k) {
+            int edits = need_off ? mm_approx(&ap, mm_item(it, oidx)) : off;
+            size_t len = v->mode == MMENU_SORT_LENGTH ? strlen(mm_item(it, oidx)) : 0;
+            primary = (size_t)edits << 24 | (len < 0xffffff ? len : 0xffffff);
+        } else if (v->mode == MMENU_SORT_LENGTH) primary = strlen(mm_item(it, oidx));
+        else if (need_off) {
+            const char *s = mm_item(it, oidx);
+            const char *m = strcasestr(s, q);
+            primary = m ? (size_t)(m - s) : 0;
+        } else primary = (size_t)off;
+        if (primary > pmax) primary = pmax;
+        v->keys[r] = (unsigned long long)primary << v->shift | (unsigned long long)oidx;
+    });
+    v->count = f->count;
+    v->segs = 1;
+    v->cut[0] = 0;
+    v->cut[1] = f->count;
+    v->done[0] = 0;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    unsigned long long x = *(const unsigned long long *)a, y = *(const unsigned long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Partition a[lo, hi) so the element of rank nth sits at a[nth], smaller ones before it. */
+static void select_u64(unsigned long long *a, long long lo, long long hi, long long nth) {
+    while (hi - lo > 1) {
+        long long mid = lo + (hi - lo) / 2;
+        unsigned long long x = a[lo], y = a[mid], z = a[hi - 1];
+        unsigned long long pivot = x < y ? (y < z ? y : (x < z ? z : x)) : (x < z ? x : (y < z ? z : y));
+        long long i = lo, j = hi - 1;
+        while (i <= j) {
+            while (a[i] < pivot) i++;
+            while (a[j] > pivot) j--;
+            if (i <= j) {
+                unsigned long long t = a[i]; a[i] = a[j]; a[j] = t;
+                i++; j--;
+            }
+        }
+        if (nth <= j) hi = j + 1;
+        else if (nth >= i) lo = i;
+        else return;
+    }
+}
+
+/* Segment holding key r. */
+static int view_seg(const sort_view *v, long long r) {
+    int lo = 0, hi = v->segs;
+    while (hi - lo > 1) {
+        int mid = lo + (hi - lo) / 2;
+        if (v->cut[mid] <= r) lo = mid; else hi = mid;
+    }
+    return lo;
+}
+
+/* Make pos a segment boundary (sorted segments need none). With no room
+   for another segment, the whole segment gets sorted instead. */
+static void view_split(sort_view *v, long long pos) {
+    if (pos <= 0 || pos >= v->count) return;
+    int s = view_seg(v, pos);
+    if (v->cut[s] == pos || v->done[s]) return;
+    if (v->segs == SORT_SEGS) {
+        qsort(v->keys + v->cut[s], (size_t)(v->cut[s + 1] - v->cut[s]), sizeof(unsigned long long), cmp_u64);
+        v->done[s] = 1;
+        return;
+    }
+    select_u64(v->keys, v->cut[s], v->cut[s + 1], pos);
+    memmove(v->cut + s + 2, v->cut + s + 1, (size_t)(v->segs - s) * sizeof(v->cut[0]));
+    memmove(v->done + s + 2, v->done + s + 1, (size_t)(v->segs - s - 1));
+    v->cut[s + 1] = pos;
+    v->done[s + 1] = 0;
+    v->segs++;
+}
+
+/* Make sure rows [lo, hi) are in final order. */
+static void view_ensure(sort_view *v, long long lo, long long hi) {
+    if (!v->keyed) return;
+    if (lo < 0) lo = 0;
+    if (hi > v->count) hi = v->count;
+    if (lo >= hi) return;
+    int s = view_seg(v, lo);
+    while (s < v->segs && v->cut[s] < hi && v->done[s]) s++;
+    if (s == v->segs || v->cut[s] >= hi) return;
+    /* Sort a chunk either side too, so scrolling on stays in sorted segments */
+    lo = lo > SORT_CHUNK ? lo - SORT_CHUNK : 0;
+    hi = hi + SORT_CHUNK < v->count ? hi + SORT_CHUNK : v->count;
+    view_split(v, lo);
+    view_split(v, hi);
+    for (s = view_seg(v, lo); s < v->segs && v->cut[s] < hi; s++) {
+        if (v->done[s]) continue;
+        qsort(v->keys + v->cut[s], (size_t)(v->cut[s + 1] - v->cut[s]), sizeof(unsigned long long), cmp_u64);
+        v->done[s] = 1;
+    }
+    /* Neighbouring sorted segments merge, keeping room for more splits */
+    int n = 1;
+    for (s = 1; s < v->segs; s++) {
+        if (v->done[s] && v->done[n - 1]) continue;
+        v->cut[n] = v->cut[s];
+        v->done[n++] = v->done[s];
+    }
+    v->cut[n] = v->count;
+    v->segs = n;
+}
+
+/* Option index shown on result row r. */
+static long long view_at(sort_view *v, filt *f, long long r) {
+    if (!v->keyed) return filt_get(f, r);
+    view_ensure(v, r, r + 1);
+    return (long long)(v->keys[r] & ((1ULL << v->shift) - 1));
+}
+
+/* ---- Terminal layer --------------------------------------------------------
+   Two backends behind one small interface. The default is ncurses. The ANSI
+   backend (MMENU_RENDER_ANSI) skips curses entirely: the tty goes into raw
+   mode, keys are decoded here into the same (KEY_CODE_YES, KEY_*) pairs
+   wget_wch returns, and every frame is composed into one reusable buffer and
+   emitted with a single write(), wrapped in synchronized-output markers
+   (DEC mode 2026) so terminals that support it never show a torn frame.
+   Cheaper per keystroke, and far fewer bytes and syscalls over SSH. */
+
+#define ESC_WAIT_MS 25   /* how long a lone ESC may wait for the rest of a sequence */
+
+/* Keys synthesised here (with KEY_CODE_YES) on top of ncurses' KEY_* codes */
+enum {
+    MM_KEY_WHEEL_UP = KEY_MAX + 1,
+    MM_KEY_WHEEL_DOWN,
+    MM_KEY_JUMP0              /* + d for Alt-d: jump to d tenths of the list */
+};
+
+typedef struct {
+    int ansi;
+    FILE *tty, *own_tty;
+    SCREEN *scr;
+
+    int fd;                       /* ANSI: raw tty fd */
+    struct termios saved;
+    char *frame;                  /* ANSI: frame under construction */
+    size_t len, cap;
+    unsigned char in[64];         /* ANSI: undecoded input bytes */
+    int in_len;
+
+    int pend_kc;                  /* a key handed back by term_unget(), if not ERR */
+    wint_t pend_ch;
+
+    long long *shown;             /* ANSI: what each list row shows (option * 2 + selected) */
+    int shown_cap;
+    int stale;                    /* ANSI: repaint every row on the next frame */
+} mm_term;
+
+static void term_put(mm_term *t, const char *s, size_t n) {
+    if (t->cap - t->len < n) {
+        while (t->cap - t->len < n) t->cap = t->cap ? t->cap * 2 : 16384;
+        t->frame = realloc(t->frame, t->cap);
+        if (!t->frame) { perror("realloc"); exit(EXIT_FAILURE); }
+    }
+    memcpy(t->frame + t->len, s, n);
+    t->len += n;
+}
+
+static void term_puts(mm_term *t, const char *s) { term_put(t, s, strlen(s)); }
+
+static void term_printf(mm_term *t, const char *fmt, ...) {
+    char tmp[64];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(tmp, sizeof(tmp), fmt, ap);
+    va_end(ap);
+    if (n > 0) term_put(t, tmp, (size_t)n < sizeof(tmp) ? (size_t)n : sizeof(tmp) - 1);
+}
+
+/* Append wide characters as multibyte. */
+static void term_put_wcs(mm_term *t, const wchar_t *w, int n) {
+    char mb[MB_LEN_MAX];
+    mbstate_t st; memset(&st, 0, sizeof(st));
+    for (int i = 0; i < n; i++) {
+        size_t k = wcrtomb(mb, w[i], &st);
+        if (k == (size_t)-1) { mb[0] = '?'; k = 1; memset(&st, 0, sizeof(st)); }
+        term_put(t, mb, k);
+    }
+}
+
+static void term_flush(mm_term *t) {
+    size_t off = 0;
+    while (off < t->len) {
+        ssize_t w = write(t->fd, t->frame + off, t->len - off);
+        if (w < 0) { if (errno == EINTR || errno == EAGAIN) continue; break; }
+        off += (size_t)w;
+    }
+    t->len = 0;
+}
+
+static int term_open(mm_term *t, const mmenu_opts *opts) {
+    memset(t, 0, sizeof(*t));
+    t->pend_kc = ERR;
+    t->stale = 1;
+    t->ansi = opts && opts->renderer == MMENU_RENDER_ANSI;
+    t->tty = opts ? opts->tty : NULL;
+    if (!t->tty) {
+        t->tty = t->own_tty = fopen("/dev/tty", "r+");
+        if (!t->tty) { perror("fopen /dev/tty"); exit(EXIT_FAILURE); }
+    }
+    if (t->ansi) {
+        t->fd = fileno(t->tty);
+        if (tcgetattr(t->fd, &t->saved) < 0) { perror("tcgetattr"); t->ansi = 0; }
+    }
+    if (t->ansi) {
+        struct termios raw = t->saved;
+        raw.c_iflag &= ~(tcflag_t)(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+        raw.c_oflag &= ~(tcflag_t)OPOST;
+        raw.c_cflag |= CS8;
+        raw.c_lflag &= ~(tcflag_t)(ECHO | ICANON | IEXTEN | ISIG);
+        raw.c_cc[VMIN] = 1;
+        raw.c_cc[VTIME] = 0;
+        tcsetattr(t->fd, TCSAFLUSH, &raw);
+        /* alt screen, normal cursor keys, SGR mouse reports (for the wheel) */
+        term_puts(t, "\033[?1049h\033[?1l\033[?1000h\033[?1006h\033[H\033[2J");
+        term_flush(t);
+        return 0;
+    }
+    t->scr = newterm(NULL, t->tty, t->tty);
+    if (!t->scr) {
+        if (t->own_tty) fclose(t->own_tty);
+        fprintf(stderr, "Failed to init ncurses\n");
+        return -1;
+    }
+    set_term(t->scr);
     cbreak(); noecho(); keypad(stdscr, TRUE);
+    mousemask(BUTTON4_PRESSED | BUTTON5_PRESSED, NULL);
+    mouseinterval(0);
+    return 0;
+}
+
+static void term_close(mm_term *t) {
+    if (t->ansi) {
+        term_puts(t, "\033[?1006l\033[?1000l\033[?1049l");
+        term_flush(t);
+        tcsetattr(t->fd, TCSAFLUSH, &t->saved);
+        free(t->frame);
+        free(t->shown);
+    } else {
+        endwin();
+        delscreen(t->scr);
+    }
+    if (t->own_tty) fclose(t->own_tty);
+}
+
+static void term_size(mm_term *t, int *rows, int *cols) {
+    if (t->ansi) {
+        struct winsize ws;
+        if (ioctl(t->fd, TIOCGWINSZ, &ws) == 0 && ws.ws_row && ws.ws_col) {
+            *rows = ws.ws_row; *cols = ws.ws_col;
+        } else {
+            *rows = 24; *cols = 80;
+        }
+        return;
+    }
+    endwin();
+    refresh();
+    getmaxyx(stdscr, *rows, *cols);
+}
+
+/* Read more input into t->in, waiting at most timeout_ms (-1 = forever). */
+static int term_fill(mm_term *t, int timeout_ms) {
+    if (t->in_len == (int)sizeof(t->in)) return 1;
+    struct pollfd p = { .fd = t->fd, .events = POLLIN };
+    if (poll(&p, 1, timeout_ms) <= 0) return 0;
+    ssize_t r = read(t->fd, t->in + t->in_len, sizeof(t->in) - (size_t)t->in_len);
+    if (r <= 0) return 0;
+    t->in_len += (int)r;
+    return 1;
+}
+
+static void term_consume(mm_term *t, int n) {
+    memmove(t->in, t->in + n, (size_t)(t->in_len - n));
+    t->in_len -= n;
+}
+
+/* Decode an escape sequence at t->in (t->in[0] == ESC). */
+static int term_decode_esc(mm_term *t, wint_t *ch) {
+    if (t->in_len == 1 && !term_fill(t, ESC_WAIT_MS)) { term_consume(t, 1); *ch = 27; return OK; }
+    if (t->in[1] >= '0' && t->in[1] <= '9') {
+        *ch = MM_KEY_JUMP0 + (t->in[1] - '0');
+        term_consume(t, 2);
+        return KEY_CODE_YES;
+    }
+    if (t->in[1] != '[' && t->in[1] != 'O') { term_consume(t, 1); *ch = 27; return OK; }
+    int end = 2;
+    for (;;) {
+        while (end < t->in_len && !(t->in[end] >= 0x40 && t->in[end] <= 0x7e)) end++;
+        if (end < t->in_len || !term_fill(t, ESC_WAIT_MS)) break;
+    }
+    if (end >= t->in_len) { term_consume(t, t->in_len); return ERR; }
+    int sgr = t->in[2] == '<';   /* mouse report: ESC [ < button ; x ; y M */
+    int num = atoi((const char *)t->in + 2 + sgr);
+    unsigned char fin = t->in[end];
+    term_consume(t, end + 1);
+    if (sgr) {
+        if (fin != 'M' || (num & 0xc2) != 64) return ERR;   /* only the vertical wheel is used */
+        *ch = num & 1 ? MM_KEY_WHEEL_DOWN : MM_KEY_WHEEL_UP;
+        return KEY_CODE_YES;
+    }
+    switch (fin) {
+    case 'A': *ch = KEY_UP; return KEY_CODE_YES;
+    case 'B': *ch = KEY_DOWN; return KEY_CODE_YES;
+    case 'C': *ch = KEY_RIGHT; return KEY_CODE_YES;
+    case 'D': *ch = KEY_LEFT; return KEY_CODE_YES;
+    case 'H': *ch = KEY_HOME; return KEY_CODE_YES;
+    case 'F': *ch = KEY_END; return KEY_CODE_YES;
+    case '~':
+        switch (num) {
+        case 1: case 7: *ch = KEY_HOME; return KEY_CODE_YES;
+        case 4: case 8: *ch = KEY_END; return KEY_CODE_YES;
+        case 3: *ch = KEY_DC; return KEY_CODE_YES;
+        case 5: *ch = KEY_PPAGE; return KEY_CODE_YES;
+        case 6: *ch = KEY_NPAGE; return KEY_CODE_YES;
+        }
+    }
+    return ERR;   /* unknown sequence: swallowed */
+}
+
+/* Hand a key back; the next term_getkey() returns it. */
+static void term_unget(mm_term *t, int kc, wint_t ch) {
+    t->pend_kc = kc;
+    t->pend_ch = ch;
+}
+
+/* wget_wch() equivalent with a timeout in ms (-1 = block). */
+static int term_getkey(mm_term *t, int timeout_ms, wint_t *ch) {
+    if (t->pend_kc != ERR) {
+        int kc = t->pend_kc;
+        *ch = t->pend_ch;
+        t->pend_kc = ERR;
+        return kc;
+    }
+    if (!t->ansi) {
+        wtimeout(stdscr, timeout_ms);
+        int kc = wget_wch(stdscr, ch);
+        if (kc == KEY_CODE_YES && *ch == KEY_MOUSE) {
+            MEVENT ev;
+            if (getmouse(&ev) != OK) return ERR;
+            if (ev.bstate & BUTTON4_PRESSED) { *ch = MM_KEY_WHEEL_UP; return KEY_CODE_YES; }
+            if (ev.bstate & BUTTON5_PRESSED) { *ch = MM_KEY_WHEEL_DOWN; return KEY_CODE_YES; }
+            return ERR;
+        }
+        if (kc == OK && *ch == 27) {
+            /* Alt-digit arrives as ESC then the digit */
+            wint_t c2;
+            wtimeout(stdscr, ESC_WAIT_MS);
+            int k2 = wget_wch(stdscr, &c2);
+            if (k2 == OK && c2 >= '0' && c2 <= '9') { *ch = MM_KEY_JUMP0 + (c2 - '0'); return KEY_CODE_YES; }
+            if (k2 != ERR) term_unget(t, k2, c2);
+        }
+        return kc;
+    }
+    if (t->in_len == 0 && !term_fill(t, timeout_ms)) return ERR;
+    unsigned char c = t->in[0];
+    if (c == 27) return term_decode_esc(t, ch);
+    if (c == 127 || c == 8) { term_consume(t, 1); *ch = KEY_BACKSPACE; return KEY_CODE_YES; }
+    if (c < 0x80) { term_consume(t, 1); *ch = c; return OK; }
+    int need = c >= 0xf0 ? 4 : c >= 0xe0 ? 3 : 2;
+    while (t->in_len < need && term_fill(t, ESC_WAIT_MS));
+    wchar_t wc;
+    mbstate_t st; memset(&st, 0, sizeof(st));
+    size_t k = mbrtowc(&wc, (const char *)t->in, (size_t)t->in_len, &st);
+    if (k == (size_t)-1 || k == (size_t)-2 || k == 0) { term_consume(t, 1); return ERR; }
+    term_consume(t, (int)k);
+    *ch = (wint_t)wc;
+    return OK;
+}
+
+/* Sanitise s[0, len) for display into at most width columns: tabs expand,
+   ANSI escape sequences and other control bytes are dropped. ASCII rows
+   (MMENU_LINE_ASCII in flags) go to cbuf byte for byte; anything else is
+   decoded into wbuf, bytes that are not valid UTF-8 becoming U+FFFD.
+   Returns the number of chars written. */
+static int mm_sanitize(const char *s, size_t len, int width, unsigned char flags,
+                       wchar_t *wbuf, char *cbuf, int cap) {
+    int ascii = flags & MMENU_LINE_ASCII;
+    int n = 0, col = 0;
+    size_t i = 0;
+    while (i < len && n < cap) {
+        unsigned char c = (unsigned char)s[i];
+        if (c == 27) {
+            i++;
+            if (i < len && s[i] == '[') {
+                i++;
+                while (i < len && !((unsigned char)s[i] >= 0x40 && (unsigned char)s[i] <= 0x7e)) i++;
+            }
+            i++;
+            continue;
+        }
+        if (c == '\t') {
+            int stop = (col / 8 + 1) * 8;
+            for (; col < stop && col < width && n < cap; col++) {
+                if (ascii) cbuf[n++] = ' ';
+                else wbuf[n++] = L' ';
+            }
+            i++;
+            continue;
+        }
+        if (c < 32 || c == 127) { i++; continue; }
+        if (ascii) {
+            if (col >= width) break;
+            cbuf[n++] = (char)c;
+            col++;
+            i++;
+            continue;
+        }
+        unsigned cp;
+        size_t k = mm_utf8_decode((const unsigned char *)s + i, len - i, &cp);
+        if (!k) { cp = 0xfffd; k = 1; }
+        int w = wcwidth((wchar_t)cp);
+        if (w < 0) w = 1;
+        if (col + w > width) break;
+        wbuf[n++] = (wchar_t)cp;
+        col += w;
+        i += k;
+    }
+    return n;
+}
+
+/* Draw one text line at (y, x), clipped to width columns. */
+static void term_text(mm_term *t, int y, int x, int width, const char *s, size_t len,
+                      unsigned char flags) {
+    wchar_t wbuf[512];
+    char cbuf[512];
+    int n = mm_sanitize(s, len, width, flags, wbuf, cbuf, 512);
+    if (t->ansi) {
+        term_printf(t, "\033[%d;%dH", y + 1, x + 1);
+        if (flags & MMENU_LINE_ASCII) term_put(t, cbuf, (size_t)n);
+        else term_put_wcs(t, wbuf, n);
+    } else if (flags & MMENU_LINE_ASCII) {
+        mvaddnstr(y, x, cbuf, n);
+    } else {
+        mvaddnwstr(y, x, wbuf, n);
+    }
+}
+
+static void preview_draw(mm_term *t, const preview_t *p, int x, int width, int rows) {
+    if (!p->buf || width <= 0) return;
+    const char *s = p->buf, *end = p->buf + p->len;
+    for (int y = 1; y < rows && s < end; y++) {
+        const char *nl = memchr(s, '\n', (size_t)(end - s));
+        size_t n = nl ? (size_t)(nl - s) : (size_t)(end - s);
+        term_text(t, y, x, width, s, n, mmenu_utf8_flags(s, n));
+        s += n + 1;
+    }
+}
+
+/* Full frame: prompt line, the visible window of matches and the preview pane. */
+static void mm_draw(mm_term *t, mm_items *it, filt *filtered, sort_view *view,
+                    const char *prompt_str, const wchar_t *input, long long selection, long long top,
+                    int rows, int cols, const preview_t *pv) {
+    int list_w = cols;
+    if (pv->cmd) {
+        list_w = cols / 2;
+        if (list_w < 1) list_w = 1;
+    }
+    int visible = rows - 1;
+    view_ensure(view, top, top + visible);
+
+    if (t->ansi) {
+        term_puts(t, "\033[?2026h\033[H");
+        term_puts(t, prompt_str);
+        term_put_wcs(t, input, (int)wcslen(input));
+        term_puts(t, "\033[K");
+        /* Rows showing what they showed last frame are left alone, so moving
+           the selection rewrites two rows. The preview pane shares the rows'
+           line clears, so it forces a full repaint. */
+        if (t->shown_cap < visible) {
+            t->shown = realloc(t->shown, (size_t)visible * sizeof(*t->shown));
+            if (!t->shown) { perror("realloc"); exit(EXIT_FAILURE); }
+            t->shown_cap = visible;
+            t->stale = 1;
+        }
+        if (pv->cmd) t->stale = 1;
+        for (int v = 0; v < visible; v++) {
+            long long fidx = top + v;
+            long long oidx = fidx < filtered->count ? view_at(view, filtered, fidx) : -1;
+            long long key = oidx < 0 ? -1 : oidx * 2 + (fidx == selection);
+            if (!t->stale && t->shown[v] == key) continue;
+            t->shown[v] = key;
+            if (oidx >= 0) {
+                const char *line = mm_item(it, oidx);
+                size_t len = strlen(line);
+                if (fidx == selection) term_puts(t, "\033[7m");
+                term_text(t, v + 1, 0, list_w, line, len, mm_item_flags(it, oidx, line, len));
+                if (fidx == selection) term_puts(t, "\033[0m");
+            } else {
+                term_printf(t, "\033[%d;1H", v + 2);
+            }
+            term_puts(t, "\033[K");
+        }
+        t->stale = 0;
+        if (pv->cmd) {
+            const char *bar = MB_CUR_MAX > 1 ? "\xe2\x94\x82" : "|";   /* U+2502 */
+            for (int y = 1; y < rows; y++) {
+                term_printf(t, "\033[%d;%dH", y + 1, list_w + 1);
+                term_puts(t, bar);
+            }
+            preview_draw(t, pv, list_w + 2, cols - list_w - 2, rows);
+        }
+        term_printf(t, "\033[1;%dH", (int)(strlen(prompt_str) + wcslen(input)) + 1);
+        term_puts(t, "\033[?2026l");
+        term_flush(t);
+        return;
+    }
+
+    /* erase(), not clear(): curses then sends only the cells that changed */
+    erase();
+    printw("%s%ls", prompt_str, input); clrtoeol();
+    for (int v = 0; v < visible && top + v < filtered->count; v++) {
+        long long fidx = top + v;
+        long long oidx = view_at(view, filtered, fidx);
+        const char *line = mm_item(it, oidx);
+        size_t len = strlen(line);
+        if (fidx == selection) attron(A_STANDOUT);
+        term_text(t, v + 1, 0, list_w, line, len, mm_item_flags(it, oidx, line, len));
+        if (fidx == selection) attroff(A_STANDOUT);
+    }
+    if (pv->cmd) {
+        for (int y = 1; y < rows; y++) mvaddch(y, list_w, ACS_VLINE);
+        preview_draw(t, pv, list_w + 2, cols - list_w - 2, rows);
+    }
+    move(0, (int)(strlen(prompt_str) + wcslen(input)));
+    refresh();
+}
+
+static void mm_hit(void *ctx, long long i, int off) { filt_push(ctx, i, off); }
+
+#define WHEEL_ROWS 3
+
+/* Apply navigation key ch to the selection and the window's first row;
+   returns 0 if ch does not navigate. Constant work whatever the jump: rows
+   are random access, and the scroll step after it only clamps top. */
+static int mm_nav(wint_t ch, long long *sel, long long *top, long long count, int visible) {
+    long long page = visible > 1 ? visible - 1 : 1;
+    long long s = *sel, t = *top;
+    switch (ch) {
+    case KEY_UP: s--; break;
+    case KEY_DOWN: s++; break;
+    case KEY_PPAGE: s -= page; t -= page; break;
+    case KEY_NPAGE: s += page; t += page; break;
+    case KEY_HOME: s = 0; break;
+    case KEY_END: s = count - 1; break;
+    case MM_KEY_WHEEL_UP: s -= WHEEL_ROWS; t -= WHEEL_ROWS; break;
+    case MM_KEY_WHEEL_DOWN: s += WHEEL_ROWS; t += WHEEL_ROWS; break;
+    default:
+        if (ch < MM_KEY_JUMP0 || ch > MM_KEY_JUMP0 + 9) return 0;
+        s = (long long)((double)count * (ch - MM_KEY_JUMP0) / 10);
+        t = s - visible / 2;   /* land mid-window */
+    }
+    if (s >= count) s = count - 1;
+    if (s < 0) s = 0;
+    *sel = s;
+    *top = t < 0 ? 0 : t;
+    return 1;
+}
+
+/* The interactive loop, shared by the array and the virtual entry points. */
+static long long mm_run(mm_items *it, long long n_options, const char *prompt, const mmenu_opts *opts) {
+    setlocale(LC_ALL, "");
+
+    mm_term term;
+    if (term_open(&term, opts) < 0) return -1;
     signal(SIGWINCH, handle_resize);
 
-    int rows, cols; getmaxyx(stdscr, rows, cols);
+    int rows, cols; term_size(&term, &rows, &cols);
 
     wchar_t input[MAX_INPUT_LEN + 1] = {0};
     int input_len = 0;
 
     filt filtered; filt_init(&filtered);
+    filt spare; filt_init(&spare);   /* the next result set is built here, then swapped in */
+
+    preview_t pv; preview_init(&pv, opts);
+    source_t src; source_init(&src, opts);
+    sort_view view; view_init(&view, opts);
+    /* Masks describe the caller's options; producer rows have none */
+    const unsigned long long *masks = opts && !src.cmd ? opts->masks : NULL;
+    int (*feed)(void *, const char *const **, const unsigned long long **, long long *) =
+        opts && !src.cmd ? opts->feed : NULL;
+    int typos = opts ? opts->typos : 0;
+    /* Flags only stay in step with options nothing appends to */
+    if (!it->vl && !feed && !src.cmd && opts) it->flags = opts->flags;
 
-    int selection = 0;
-    int top = 0;
+    long long selection = 0;
+    long long top = 0;
     int need_filter = 0;
     int prev_input_len = 0;   /* for incremental filter optimization */
+    int prev_k = 0;           /* edits allowed for the query filtered holds */
+    spec_t spec = {0};        /* idle-time guesses at the next keystroke */
+    mm_cost cost;             /* picks refine or rescan per keystroke */
+    cost_calibrate(&cost, it, masks, src.cmd ? 0 : n_options);
 
     const char *prompt_str = prompt ? prompt : "> ";
-    size_t prompt_len = strlen(prompt_str);
 
-    int ret = -1;
+    long long ret = -1;
 
     /* Initial filter (show all for empty query - fast path) */
     filt_clear(&filtered);
-    if (input[0] == L'\0') {
-        for (int i = 0; i < n_options; i++) filt_push(&filtered, i);
+    if (src.cmd) {
+        source_request(&src, "", mm_now_ms());
+        it->arr = src.lines; it->vl = NULL; it->flags = NULL; n_options = src.count;
+        source_sync(&src, &filtered);
+    } else if (input[0] == L'\0') {
+        filt_all(&filtered, n_options);
     } else {
         char *q = wc_to_mb(input);
         if (q) {
-            for (int i = 0; i < n_options; i++) {
-                if (strcasestr(options[i], q)) filt_push(&filtered, i);
-            }
+            mm_match_tail(it, masks, 0, n_options, q, typos, &filtered);
+            if (!typos) spec_start(&spec, it, &filtered, q);
             free(q);
         }
     }
     if (filtered.count > 0) selection = 0;
+    view_reset(&view, it, &filtered, NULL);
 
     /* Initial draw */
-    clear();
-    printw("%s%ls", prompt_str, input); clrtoeol();
-    move(0, (int)(prompt_len + input_len));
     int visible = rows - 1;
-    for (int v = 0; v < visible && top + v < filtered.count; v++) {
-        int fidx = top + v;
-        int oidx = filtered.indices[fidx];
-        wchar_t *w = mb_to_wc(options[oidx]);
-        if (w) {
-            move(v + 1, 0);
-            if (fidx == selection) attron(A_STANDOUT);
-            printw("%.*ls", cols, w);
-            if (fidx == selection) attroff(A_STANDOUT);
-            clrtoeol();
-            free(w);
-        }
-    }
-    refresh();
+    if (filtered.count > 0) preview_request(&pv, mm_item(it, view_at(&view, &filtered, selection)), mm_now_ms());
+    mm_draw(&term, it, &filtered, &view, prompt_str, input, selection, top, rows, cols, &pv);
 
     while (1) {
         if (resize_flag) {
             resize_flag = 0;
-            endwin();
-            refresh();
-            getmaxyx(stdscr, rows, cols);
+            term_size(&term, &rows, &cols);
             visible = rows - 1;
+            term.stale = 1;
+            mm_draw(&term, it, &filtered, &view, prompt_str, input, selection, top, rows, cols, &pv);
         }
 
+        long long now = mm_now_ms();
         wint_t ch;
-        int kc = wget_wch(stdscr, &ch);
-        if (kc == ERR) continue;
+        int timeout = mm_min_timeout(preview_timeout(&pv, now), source_timeout(&src, now));
+        if (feed) timeout = mm_min_timeout(timeout, FEED_POLL_MS);
+        if (spec_busy(&spec)) timeout = 0;
+        int kc = term_getkey(&term, timeout, &ch);
+        if (kc == ERR) {
+            /* Idle: let children and live input make progress without ever blocking input */
+            now = mm_now_ms();
+            int dirty = 0;
+            long long old_n = n_options;
+            const char *const *arr = it->arr;
+            long long fed_n = n_options;
+            if (feed && feed(opts->feed_ud, &arr, &masks, &fed_n) && fed_n > old_n) {
+                it->arr = arr;
+                n_options = fed_n;
+                /* Only the appended lines are matched; existing results stand */
+                char *q = wc_to_mb(input);
+                mm_match_tail(it, masks, old_n, n_options, q, typos, &filtered);
+                view_reset(&view, it, &filtered, q);
+                spec_grow(&spec, &filtered);
+                free(q);
+                if (filtered.count > 0) preview_request(&pv, mm_item(it, view_at(&view, &filtered, selection)), now);
+                dirty = 1;
+            }
+            if (source_tick(&src, now)) {
+                spec_stop(&spec);
+                it->arr = src.lines; it->vl = NULL; it->flags = NULL; n_options = src.count;
+                source_sync(&src, &filtered);
+                view_reset(&view, it, &filtered, NULL);
+                if (selection >= filtered.count) selection = filtered.count > 0 ? filtered.count - 1 : 0;
+                if (filtered.count > 0) preview_request(&pv, mm_item(it, view_at(&view, &filtered, selection)), now);
+                dirty = 1;
+            }
+            if (preview_tick(&pv, now, rows - 1)) dirty = 1;
+            if (dirty) {
+                term.stale = 1;
+                mm_draw(&term, it, &filtered, &view, prompt_str, input, selection, top, rows, cols, &pv);
+            } else {
+                spec_step(&spec, it, masks, &filtered);
+            }
+            continue;
+        }
 
         need_filter = 0;
 
-        if (kc == KEY_CODE_YES) {
-            if (ch == KEY_UP && selection > 0) selection--;
-            else if (ch == KEY_DOWN && selection < filtered.count - 1) selection++;
-            else if (ch == KEY_BACKSPACE || ch == 127 || ch == 8) {
+        if (kc == KEY_CODE_YES && mm_nav(ch, &selection, &top, filtered.count, visible)) {
+            /* Keys held down queue up faster than frames: apply every
+               navigation key already waiting, then draw once */
+            while ((kc = term_getkey(&term, 0, &ch)) != ERR) {
+                if (kc != KEY_CODE_YES || !mm_nav(ch, &selection, &top, filtered.count, visible)) {
+                    term_unget(&term, kc, ch);
+                    break;
+                }
+            }
+        } else if (kc == KEY_CODE_YES) {
+            if (ch == KEY_BACKSPACE || ch == 127 || ch == 8) {
                 if (input_len > 0) { input[--input_len] = L'\0'; need_filter = 1; }
             }
         } else {
             if (ch == 27 || ch == 3 || ch == 4) { ret = -1; goto cleanup; }
             if (ch == '\n' || ch == '\r' || ch == KEY_ENTER) {
-                if (filtered.count > 0) ret = filtered.indices[selection];
+                if (filtered.count > 0) ret = view_at(&view, &filtered, selection);
                 goto cleanup;
             }
             if (iswprint(ch) && input_len < MAX_INPUT_LEN) {
@@ -169,43 +2011,68 @@ int mmenu(const char *const *options, int n_options, const char *prompt) {
             }
         }
 
-        if (need_filter) {
+        if (need_filter) term.stale = 1;
+        if (need_filter && src.cmd) {
+            /* The producer does the filtering; just re-run it for the new query */
             char *q = wc_to_mb(input);
-            int do_full = 1;
-            if (q && input_len > prev_input_len && filtered.count > 0) {
-                /* Common case: user typed another char. Refine only the previous matches. */
-                filt newf;
-                newf.cap = filtered.count < INITIAL_CAP ? INITIAL_CAP : filtered.count;
-                newf.indices = malloc(newf.cap * sizeof(int));
-                if (newf.indices) {
-                    newf.count = 0;
-                    for (int k = 0; k < filtered.count; k++) {
-                        int oidx = filtered.indices[k];
-                        if (strcasestr(options[oidx], q)) {
-                            if (newf.count == newf.cap) {
-                                newf.cap *= 2;
-                                newf.indices = realloc(newf.indices, newf.cap * sizeof(int));
-                                if (!newf.indices) break;
-                            }
-                            newf.indices[newf.count++] = oidx;
-                        }
-                    }
-                    /* Swap in the smaller refined list */
-                    free(filtered.indices);
-                    filtered = newf;
-                    do_full = 0;
-                }
-            }
-            if (do_full) {
-                filt_clear(&filtered);
-                if (!q || q[0] == '\0') {
-                    for (int i = 0; i < n_options; i++) filt_push(&filtered, i);
-                } else {
-                    for (int i = 0; i < n_options; i++) {
-                        if (strcasestr(options[i], q)) filt_push(&filtered, i);
+            source_request(&src, q ? q : "", mm_now_ms());
+            it->arr = src.lines; it->vl = NULL; it->flags = NULL; n_options = src.count;
+            filt_clear(&filtered);
+            source_sync(&src, &filtered);
+            view_reset(&view, it, &filtered, NULL);
+            free(q);
+            selection = 0;
+            top = 0;
+        } else if (need_filter) {
+            char *q = wc_to_mb(input);
+            filt got;
+            /* A longer query only narrows the matches unless it is allowed more edits */
+            int refine = q && input_len > prev_input_len && filtered.count > 0 && !(it->vl && it->vl->match) &&
+                         mm_query_k(q, typos) <= prev_k;
+            filt_clear(&spare);
+            spare.universe = n_options;
+            cost.recheck = 0;
+            if (refine && input_len == prev_input_len + 1 &&
+                spec_take(&spec, input[input_len - 1], it, masks, &filtered, &got)) {
+                /* Guessed while idle */
+                filt_free(&spare);
+                spare = got;
+            } else if (refine && cost_prefer_refine(&cost, filtered.count, n_options)) {
+                /* User typed another char. Refine only the previous matches.
+                   Any match of the longer query also matches the shorter one, so it
+                   cannot start before the shorter query's first match: resume there
+                   instead of rescanning each line from byte 0. */
+                long long t0 = mm_now_ns();
+                unsigned long long qmask = mmenu_charmask(q, strlen(q));
+                int k = mm_query_k(q, typos);
+                /* Stored offsets are edit counts while matching with typos */
+                int resume = !prev_k;
+                mm_approx_t ap;
+                if (k) mm_approx_init(&ap, q, k);
+                FILT_FOREACH(&filtered, r, oidx, off, {
+                    if (masks && !mm_mask_ok(masks[oidx], qmask, k)) continue;
+                    const char *s = mm_item(it, oidx);
+                    if (k) {
+                        int e = mm_approx(&ap, s);
+                        if (e >= 0) filt_push(&spare, oidx, e);
+                        continue;
                     }
-                }
+                    const char *m = strcasestr(s + (resume ? off : 0), q);
+                    if (m) filt_push(&spare, oidx, (int)(m - s));
+                });
+                cost_update(&cost, &cost.refine_ns, mm_now_ns() - t0, filtered.count);
+            } else {
+                long long t0 = mm_now_ns();
+                mm_match_tail(it, masks, 0, n_options, q, typos, &spare);
+                if (q && *q && !(it->vl && it->vl->match))
+                    cost_update(&cost, &cost.scan_ns, mm_now_ns() - t0, n_options);
             }
+            got = filtered;
+            filtered = spare;
+            spare = got;
+            view_reset(&view, it, &filtered, q);
+            prev_k = mm_query_k(q, typos);
+            if (!typos) spec_start(&spec, it, &filtered, q);
             if (q) free(q);
             prev_input_len = input_len;
             selection = filtered.count > 0 ? 0 : 0;
@@ -218,7 +2085,7 @@ int mmenu(const char *const *options, int n_options, const char *prompt) {
             if (selection < top) top = selection;
             else if (selection >= top + visible) top = selection - visible + 1;
             if (top < 0) top = 0;
-            int max_top = filtered.count - visible;
+            long long max_top = filtered.count - visible;
             if (max_top < 0) max_top = 0;
             if (top > max_top) top = max_top;
         } else {
@@ -226,31 +2093,42 @@ int mmenu(const char *const *options, int n_options, const char *prompt) {
         }
 
         /* Redraw */
-        clear();
-        printw("%s%ls", prompt_str, input); clrtoeol();
-        move(0, (int)(prompt_len + input_len));
-        for (int v = 0; v < visible && top + v < filtered.count; v++) {
-            int fidx = top + v;
-            int oidx = filtered.indices[fidx];
-            wchar_t *w = mb_to_wc(options[oidx]);
-            if (w) {
-                move(v + 1, 0);
-                if (fidx == selection) attron(A_STANDOUT);
-                printw("%.*ls", cols, w);
-                if (fidx == selection) attroff(A_STANDOUT);
-                clrtoeol();
-                free(w);
-            }
-        }
-        refresh();
+        if (filtered.count > 0) preview_request(&pv, mm_item(it, view_at(&view, &filtered, selection)), mm_now_ms());
+        mm_draw(&term, it, &filtered, &view, prompt_str, input, selection, top, rows, cols, &pv);
     }
 
 cleanup:
-    free(filtered.indices);
-    endwin();
-    delscreen(scr);
-    fclose(tty);
+    if (ret >= 0 && opts && opts->result_line) *opts->result_line = strdup(mm_item(it, ret));
+    preview_free(&pv);
+    source_free(&src);
+    free(view.keys);
+    spec_stop(&spec);
+    filt_free(&filtered);
+    filt_free(&spare);
+    term_close(&term);
     return ret;
 }
 
+int mmenu(const char *const *options, int n_options, const char *prompt) {
+    return mmenu_ex(options, n_options, prompt, NULL);
+}
+
+int mmenu_ex(const char *const *options, int n_options, const char *prompt,
+             const mmenu_opts *opts) {
+    return (int)mmenu_ex64(options, n_options, prompt, opts);
+}
+
+long long mmenu_ex64(const char *const *options, long long n_options, const char *prompt,
+                     const mmenu_opts *opts) {
+    mm_items items = { .arr = options };
+    return mm_run(&items, n_options, prompt, opts);
+}
+
+long long mmenu_virtual(const mmenu_vlist *list, const char *prompt, const mmenu_opts *opts) {
+    mm_items items = { .vl = list };
+    mmenu_opts o = opts ? *opts : (mmenu_opts){0};
+    o.feed = NULL;
+    return mm_run(&items, list->n_items, prompt, &o);
+}
+
 #endif /* MMENU_IMPLEMENTATION */
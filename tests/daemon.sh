@@ -0,0 +1,65 @@
+#!/bin/sh
+# Socket-level check of --daemon / --client against the in-process filter.
+# usage: tests/daemon.sh [path/to/mmenu]
+set -eu
+
+MMENU=${1:-./mmenu}
+DIR=$(mktemp -d)
+SOCK=$DIR/sock
+trap 'kill $PID 2>/dev/null || true; rm -rf "$DIR"' EXIT
+
+fail() { echo "FAIL: $*" >&2; exit 1; }
+
+i=0
+while [ $i -lt 20000 ]; do
+    echo "/usr/src/pkg$((i % 97))/file$i.c"
+    i=$((i + 1))
+done > "$DIR/corpus"
+
+"$MMENU" --daemon "$SOCK" 2>"$DIR/daemon.err" &
+PID=$!
+n=0
+while [ ! -S "$SOCK" ]; do
+    n=$((n + 1)); [ $n -lt 50 ] || fail "daemon did not start"; sleep 0.1
+done
+
+# load
+"$MMENU" --client "$SOCK" --corpus c --load < "$DIR/corpus" 2>"$DIR/load.out"
+grep -qx '20000 lines' "$DIR/load.out" || fail "load: $(cat "$DIR/load.out")"
+
+# filter: lines and indices must match --filter on the same input
+for q in pkg4 FILE1 .c zzz; do
+    "$MMENU" --filter "$q" < "$DIR/corpus" > "$DIR/want"
+    "$MMENU" --client "$SOCK" --corpus c -f "$q" > "$DIR/got"
+    cmp -s "$DIR/want" "$DIR/got" || fail "filter '$q' differs"
+    "$MMENU" --filter "$q" -t < "$DIR/corpus" > "$DIR/want"
+    "$MMENU" --client "$SOCK" --corpus c -f "$q" -t > "$DIR/got"
+    cmp -s "$DIR/want" "$DIR/got" || fail "filter -t '$q' differs"
+done
+
+# a load still reading its pipe must not hold up other requests
+{ sleep 2; head -n 10 "$DIR/corpus"; } | "$MMENU" --client "$SOCK" --corpus slow --load 2>/dev/null &
+LOADER=$!
+sleep 0.3
+start=$(date +%s)
+"$MMENU" --client "$SOCK" --corpus c -f pkg4 > /dev/null
+[ $(( $(date +%s) - start )) -lt 2 ] || fail "filter waited for a pending load"
+wait $LOADER
+
+# list
+printf 'c\t20000\nslow\t10\n' > "$DIR/want"
+"$MMENU" --client "$SOCK" --list | sort > "$DIR/got"
+cmp -s "$DIR/want" "$DIR/got" || fail "list: $(cat "$DIR/got")"
+
+# drop
+"$MMENU" --client "$SOCK" --corpus slow --drop
+printf 'c\t20000\n' > "$DIR/want"
+"$MMENU" --client "$SOCK" --list > "$DIR/got"
+cmp -s "$DIR/want" "$DIR/got" || fail "drop: $(cat "$DIR/got")"
+if "$MMENU" --client "$SOCK" --corpus slow -f x >/dev/null 2>&1; then fail "dropped corpus still served"; fi
+
+# stop
+"$MMENU" --client "$SOCK" --stop
+wait $PID || fail "daemon exit status $?"
+[ ! -e "$SOCK" ] || fail "socket left behind"
+echo "ok"